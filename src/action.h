@@ -26,6 +26,7 @@ ENUM(action_id_t,
   FILE_CLOSE,
   FILE_SAVE,
   FILE_SAVE_AS,
+  FILE_SAVE_ALL,
   FILE_REPAINT,
   FILE_SUSPEND,
   FILE_EXIT,
@@ -47,6 +48,7 @@ ENUM(action_id_t,
   SEARCH_REPLACE,
   SEARCH_GOTO,
   SEARCH_GOTO_MATCHING_BRACE,
+  SEARCH_GOTO_FIRST_OCCURRENCE,
   OPTIONS_INPUT,
   OPTIONS_BUFFER,
   OPTIONS_DEFAULTS,
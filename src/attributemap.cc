@@ -1,10 +1,16 @@
 #include "attributemap.h"
 
-attribute_map_t::attribute_map_t() {
+/* Versions are unique among all attribute_map_t's, such that comparing versions also detects
+   that another map was assigned. */
+static int last_version;
+
+attribute_map_t::attribute_map_t() : version(++last_version) {
   /* The normal mapping must be the first to be inserted. */
   insert_mapping("normal", 0);
 }
 
+void attribute_map_t::changed() { version = ++last_version; }
+
 optional<int> attribute_map_t::lookup_mapping(string_view name) {
   auto iter = mapping.find(name);
   if (iter != mapping.end()) {
@@ -34,15 +40,20 @@ void attribute_map_t::insert_mapping(string_view name, t3_attr_t attr) {
   auto mapping_iter = mapping.find(*known_highlights_iter);
   if (mapping_iter != mapping.end()) {
     attributes[mapping_iter->second] = attr;
+    changed();
     return;
   }
   /* Inserts based on the string in known_highlights, to ensure that the string_view member is
      initialized with a string that will outlive the mapping. */
   mapping.insert({*known_highlights_iter, attributes.size()});
   attributes.push_back(attr);
+  changed();
 }
 
-void attribute_map_t::erase_mapping(string_view name) { mapping.erase(name); }
+void attribute_map_t::erase_mapping(string_view name) {
+  mapping.erase(name);
+  changed();
+}
 
 attribute_map_t::iterator attribute_map_t::begin() const {
   return iterator(*this, mapping.begin());
@@ -39,7 +39,13 @@ class attribute_map_t {
 
   void clear_mappings();
 
+  /** Returns a number that changes whenever the mapping or any of the attributes change. */
+  int get_version() const { return version; }
+
  private:
+  void changed();
+
+  int version;
   std::set<std::string> known_highlights;
   std::map<string_view, int> mapping;
   std::vector<t3_attr_t> attributes;
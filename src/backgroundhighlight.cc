@@ -0,0 +1,61 @@
+#include "tilde/backgroundhighlight.h"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <t3widget/widget.h>
+
+#include "tilde/filebuffer.h"
+
+using namespace t3widget;
+
+namespace {
+
+// The maximum time to spend on highlighting before giving the main loop a chance to run.
+const std::chrono::milliseconds kSliceDuration(5);
+// The number of lines to process between checks of the elapsed time.
+const text_pos_t kLinesPerStep = 256;
+
+std::list<file_buffer_t *> pending_files;
+bool update_notification_connected = false;
+
+void run_slice() {
+  if (pending_files.empty()) {
+    return;
+  }
+
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + kSliceDuration;
+  while (!pending_files.empty() && std::chrono::steady_clock::now() < deadline) {
+    if (!pending_files.front()->advance_highlight(kLinesPerStep)) {
+      pending_files.pop_front();
+    }
+  }
+
+  // Ensure the main loop calls us again once it has handled any pending input.
+  if (!pending_files.empty()) {
+    signal_update();
+  }
+}
+
+}  // namespace
+
+void schedule_background_highlight(file_buffer_t *file) {
+  if (!update_notification_connected) {
+    connect_update_notification(run_slice);
+    update_notification_connected = true;
+  }
+
+  if (std::find(pending_files.begin(), pending_files.end(), file) != pending_files.end()) {
+    return;
+  }
+  // Files shown in a window are the most likely to be painted soon.
+  if (file->get_has_window()) {
+    pending_files.push_front(file);
+  } else {
+    pending_files.push_back(file);
+  }
+  signal_update();
+}
+
+void cancel_background_highlight(file_buffer_t *file) { pending_files.remove(file); }
@@ -0,0 +1,22 @@
+#ifndef BACKGROUNDHIGHLIGHT_H_
+#define BACKGROUNDHIGHLIGHT_H_
+
+class file_buffer_t;
+
+/** Schedule @p file for precomputing its highlighting states while the user is idle.
+
+    Painting a line requires the highlighting state at the start of that line, which in turn
+    requires matching all lines before it. Computing these states ahead of time means that jumping
+    far into a large file does not stall. The work is done in slices of a few milliseconds from
+    the update notification of the main loop. Therefore the buffers are only accessed from the
+    main thread, and key presses are handled between slices.
+
+    Scheduling a file that is already scheduled is cheap, and continues from the last line of the
+    file with a valid start state. Thus invalidating the highlighting restarts the work at the invalidated line.
+*/
+void schedule_background_highlight(file_buffer_t *file);
+
+/** Stop precomputing highlighting states for @p file. */
+void cancel_background_highlight(file_buffer_t *file);
+
+#endif
@@ -0,0 +1,124 @@
+#include "tilde/backgroundwordindex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <t3widget/widget.h>
+#include <vector>
+
+#include "tilde/filebuffer.h"
+#include "tilde/worker_pool.h"
+
+using namespace t3widget;
+
+namespace {
+
+// The maximum time to spend on copying lines before giving the main loop a chance to run.
+const std::chrono::milliseconds kSliceDuration(5);
+// The number of lines to copy between checks of the elapsed time.
+const text_pos_t kLinesPerStep = 256;
+
+struct build_result_t {
+  file_buffer_t *file;
+  int build_id;
+  std::unique_ptr<word_index_t> index;
+};
+
+// The files of which the lines are being copied, before their builds are started.
+std::list<file_buffer_t *> pending_files;
+/* The files for which a build is running, with an id to recognize the build. A file may be
+   destroyed and another allocated at the same address while a build is running. Only accessed
+   from the main thread. */
+std::map<file_buffer_t *, int> running_builds;
+int last_build_id;
+bool update_notification_connected = false;
+
+// Builds that have finished, but have not been handed to their files yet.
+std::mutex finished_lock;
+std::vector<build_result_t> finished_builds;
+
+void start_build(file_buffer_t *file) {
+  int build_id = ++last_build_id;
+  running_builds[file] = build_id;
+
+  std::shared_ptr<std::vector<std::string>> lines =
+      std::make_shared<std::vector<std::string>>(file->take_word_index_copy());
+  worker_pool.submit([file, build_id, lines] {
+    std::unique_ptr<word_index_t> index = make_unique<word_index_t>();
+    index->build(*lines);
+    {
+      std::unique_lock<std::mutex> guard(finished_lock);
+      finished_builds.push_back(build_result_t{file, build_id, std::move(index)});
+    }
+    /* Wake up the main loop, such that the update notification installs the index. This is the
+       one call into libt3widget that tasks may make, see worker_pool_t. */
+    signal_update();
+  });
+}
+
+void copy_lines() {
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + kSliceDuration;
+  while (!pending_files.empty() && std::chrono::steady_clock::now() < deadline) {
+    file_buffer_t *file = pending_files.front();
+    if (file->copy_word_index_lines(kLinesPerStep)) {
+      pending_files.pop_front();
+      start_build(file);
+    }
+  }
+
+  // Ensure the main loop calls us again once it has handled any pending input.
+  if (!pending_files.empty()) {
+    signal_update();
+  }
+}
+
+void install_finished_builds() {
+  std::vector<build_result_t> results;
+  {
+    std::unique_lock<std::mutex> guard(finished_lock);
+    results.swap(finished_builds);
+  }
+  for (build_result_t &result : results) {
+    auto iter = running_builds.find(result.file);
+    if (iter == running_builds.end() || iter->second != result.build_id) {
+      continue;
+    }
+    running_builds.erase(iter);
+    result.file->install_word_index(std::move(*result.index));
+  }
+}
+
+void run_slice() {
+  install_finished_builds();
+  copy_lines();
+}
+
+}  // namespace
+
+void schedule_word_index_build(file_buffer_t *file) {
+  if (!update_notification_connected) {
+    connect_update_notification(run_slice);
+    update_notification_connected = true;
+  }
+  if (running_builds.count(file) != 0 ||
+      std::find(pending_files.begin(), pending_files.end(), file) != pending_files.end()) {
+    return;
+  }
+  // Files shown in a window are the most likely to be used for completion soon.
+  if (file->get_has_window()) {
+    pending_files.push_front(file);
+  } else {
+    pending_files.push_back(file);
+  }
+  signal_update();
+}
+
+void cancel_word_index_build(file_buffer_t *file) {
+  pending_files.remove(file);
+  running_builds.erase(file);
+}
@@ -0,0 +1,21 @@
+#ifndef BACKGROUNDWORDINDEX_H_
+#define BACKGROUNDWORDINDEX_H_
+
+class file_buffer_t;
+
+/** Build the word index of @p file on a worker thread.
+
+    The lines of the file are copied first, such that the worker does not access the buffer. This
+    is done in slices of a few milliseconds from the update notification of the main loop, such
+    that large files do not hold up the handling of input. Once the index is built, it is handed
+    to the file from the update notification as well. The changes made to the file in the
+    meantime are recorded, and applied to the index when it is handed over.
+
+    Scheduling a file that is already being indexed does nothing.
+*/
+void schedule_word_index_build(file_buffer_t *file);
+
+/** Discard the result of a scheduled build for @p file. */
+void cancel_word_index_build(file_buffer_t *file);
+
+#endif
@@ -0,0 +1,507 @@
+#include "tilde/backupstore.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <t3config/config.h>
+#include <t3widget/util.h>
+#include <unistd.h>
+#include <vector>
+
+#include "tilde/copy_file.h"
+#include "tilde/log.h"
+#include "tilde/option.h"
+#include "tilde/util.h"
+
+namespace {
+
+const char kVersionsDir[] = "/versions/";
+const char kObjectsDir[] = "/objects";
+// Records the name of the file for which the versions in a directory were stored.
+const char kPathFile[] = "path";
+/* Holds the number of bytes in the store and the time they were last counted, such that the
+   store only has to be scanned when it grows beyond the budget. */
+const char kSizeFile[] = "/size";
+// Count the store again after this many seconds, to correct for changes made by other means.
+const time_t kRescanInterval = 24 * 60 * 60;
+
+/* Guards the parts of the store that are shared between files: the objects directory and
+   eviction. The store may be used concurrently when saving multiple files at once. */
+std::mutex store_lock;
+
+std::string store_root() {
+  std::unique_ptr<char, free_deleter> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0));
+  if (xdg_path == nullptr) {
+    return std::string();
+  }
+  return std::string(xdg_path.get()) + "/backups";
+}
+
+int hash_file(int fd, std::string *hash) {
+  fnv_hash_t fnv_hash;
+  char buffer[32768];
+  off_t offset = 0;
+  while (true) {
+    ssize_t read_bytes = pread(fd, buffer, sizeof(buffer), offset);
+    if (read_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    } else if (read_bytes == 0) {
+      break;
+    }
+    fnv_hash.update(buffer, read_bytes);
+    offset += read_bytes;
+  }
+  *hash = fnv_hash.hex() + "-" + std::to_string(offset);
+  return 0;
+}
+
+bool same_contents(int fd_a, int fd_b) {
+  char buffer_a[16384];
+  char buffer_b[16384];
+  off_t offset = 0;
+  while (true) {
+    ssize_t read_a, read_b;
+    while ((read_a = pread(fd_a, buffer_a, sizeof(buffer_a), offset)) < 0 && errno == EINTR) {
+    }
+    while ((read_b = pread(fd_b, buffer_b, sizeof(buffer_b), offset)) < 0 && errno == EINTR) {
+    }
+    if (read_a != read_b || read_a < 0) {
+      return false;
+    }
+    if (read_a == 0) {
+      return true;
+    }
+    if (memcmp(buffer_a, buffer_b, read_a) != 0) {
+      return false;
+    }
+    offset += read_a;
+  }
+}
+
+void sync_dir(const std::string &dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// Version names are UTC time stamps, such that sorting them by name sorts them by age.
+std::string version_stamp() {
+  struct timespec now;
+  struct tm now_tm;
+  char buffer[64];
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  gmtime_r(&now.tv_sec, &now_tm);
+  size_t length = strftime(buffer, sizeof(buffer), "%Y%m%dT%H%M%S", &now_tm);
+  snprintf(buffer + length, sizeof(buffer) - length, ".%09ldZ", static_cast<long>(now.tv_nsec));
+  return buffer;
+}
+
+// Returns the number of bytes allocated for @p name, or 0 if it can not be determined.
+off_t allocated_size(const std::string &name) {
+  struct stat statbuf;
+  if (lstat(name.c_str(), &statbuf) < 0) {
+    return 0;
+  }
+  return static_cast<off_t>(statbuf.st_blocks) * 512;
+}
+
+void record_path(const std::string &version_dir, const std::string &path) {
+  std::string path_file = version_dir + "/" + kPathFile;
+  int fd = open(path_file.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600);
+  if (fd < 0) {
+    return;
+  }
+  std::string contents = path + "\n";
+  nosig_write(fd, contents.data(), contents.size());
+  close(fd);
+}
+
+// Flush the temporary file to disk and give it its final name.
+int finish_temp(int *temp_fd, const std::string &temp_name, const std::string &name) {
+  int result = 0;
+  if (fsync(*temp_fd) < 0) {
+    result = errno;
+  }
+  if (close(*temp_fd) < 0 && result == 0) {
+    result = errno;
+  }
+  *temp_fd = -1;
+  if (result == 0 && rename(temp_name.c_str(), name.c_str()) < 0) {
+    result = errno;
+  }
+  return result;
+}
+
+/* Store the contents of @p fd in the objects directory, if they are not in there already, and
+   make @p name a hard link to the stored contents. @p added is set to the number of bytes this
+   added to the store. */
+int store_object(int fd, const std::string &objects_dir, int *temp_fd,
+                 const std::string &temp_name, const std::string &name, off_t *added) {
+  std::string hash;
+  int result;
+  if ((result = hash_file(fd, &hash)) != 0) {
+    return result;
+  }
+  std::string object_name = objects_dir + "/" + hash;
+
+  {
+    std::unique_lock<std::mutex> guard(store_lock);
+    int object_fd = open(object_name.c_str(), O_RDONLY);
+    if (object_fd >= 0) {
+      bool same = same_contents(fd, object_fd);
+      close(object_fd);
+      if (same) {
+        return link(object_name.c_str(), name.c_str()) < 0 ? errno : 0;
+      }
+      // A hash collision. Store a private copy for this version rather than sharing.
+      lprintf("Backup store hash collision for %s\n", object_name.c_str());
+      object_name.clear();
+    }
+  }
+
+  if ((result = copy_file(fd, *temp_fd)) != 0) {
+    return result;
+  }
+  if (object_name.empty()) {
+    if ((result = finish_temp(temp_fd, temp_name, name)) == 0) {
+      *added = allocated_size(name);
+    }
+    return result;
+  }
+  std::unique_lock<std::mutex> guard(store_lock);
+  if ((result = finish_temp(temp_fd, temp_name, object_name)) != 0) {
+    return result;
+  }
+  if (link(object_name.c_str(), name.c_str()) < 0) {
+    return errno;
+  }
+  *added = allocated_size(object_name);
+  sync_dir(objects_dir);
+  return 0;
+}
+
+struct stored_file_t {
+  std::string name;
+  // The name of the version within its directory, which sorts by age.
+  std::string stamp;
+  ino_t ino;
+  // The number of bytes allocated for the file.
+  off_t size;
+};
+
+std::vector<stored_file_t> list_dir(const std::string &dir) {
+  std::vector<stored_file_t> result;
+  DIR *dir_handle = opendir(dir.c_str());
+  if (dir_handle == nullptr) {
+    return result;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir_handle)) != nullptr) {
+    // Skip ., .. and temporary files, which are only renamed into place once complete.
+    if (entry->d_name[0] == '.' || strcmp(entry->d_name, kPathFile) == 0) {
+      continue;
+    }
+    std::string name = dir + "/" + entry->d_name;
+    struct stat statbuf;
+    if (lstat(name.c_str(), &statbuf) == 0) {
+      result.push_back(stored_file_t{name, entry->d_name, statbuf.st_ino,
+                                     static_cast<off_t>(statbuf.st_blocks) * 512});
+    }
+  }
+  closedir(dir_handle);
+  return result;
+}
+
+/* Remove a version, and the object it links to if no other version does. Returns the number of
+   bytes freed. */
+off_t remove_version(const stored_file_t &version, const std::string &objects_dir) {
+  struct stat statbuf;
+  if (lstat(version.name.c_str(), &statbuf) < 0) {
+    return 0;
+  }
+  // Versions that are not linked to an object have a single link. Those with two links are the
+  // last version linked to their object, which is named by its contents.
+  std::string object_name;
+  if (statbuf.st_nlink == 2) {
+    int fd = open(version.name.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      std::string hash;
+      if (hash_file(fd, &hash) == 0) {
+        object_name = objects_dir + "/" + hash;
+      }
+      close(fd);
+    }
+  }
+  if (unlink(version.name.c_str()) < 0) {
+    return 0;
+  }
+  if (statbuf.st_nlink == 1) {
+    return version.size;
+  }
+  struct stat object_stat;
+  if (!object_name.empty() && lstat(object_name.c_str(), &object_stat) == 0 &&
+      object_stat.st_ino == statbuf.st_ino && object_stat.st_nlink == 1 &&
+      unlink(object_name.c_str()) == 0) {
+    return version.size;
+  }
+  // The object is removed by the next scan of the store, and counted until then.
+  return 0;
+}
+
+/* Remove the oldest versions of a single file, until at most @p max_versions remain. Returns the
+   number of bytes freed. */
+off_t limit_versions(const std::string &version_dir, const std::string &objects_dir,
+                     size_t max_versions) {
+  std::vector<stored_file_t> versions = list_dir(version_dir);
+  if (versions.size() <= max_versions) {
+    return 0;
+  }
+  std::sort(versions.begin(), versions.end(),
+            [](const stored_file_t &a, const stored_file_t &b) { return a.stamp < b.stamp; });
+  off_t removed = 0;
+  for (size_t i = 0; i < versions.size() - max_versions; ++i) {
+    removed += remove_version(versions[i], objects_dir);
+  }
+  return removed;
+}
+
+/* Scan the whole store, and remove the oldest versions until it fits in the budget. The size of a
+   file is counted once, even if it is linked from multiple versions. Files that are reflinks are
+   counted fully, as there is no way to find out how many blocks they share. Returns the number of
+   bytes in the store afterwards, or -1 if it could not be read. */
+off_t scan_and_evict(const std::string &root, const std::string &keep) {
+  struct inode_info_t {
+    off_t size = 0;
+    size_t links = 0;
+    std::string object_name;
+  };
+  std::map<ino_t, inode_info_t> inodes;
+  std::vector<stored_file_t> versions;
+  std::vector<std::string> version_dirs;
+
+  DIR *dir_handle = opendir((root + kVersionsDir).c_str());
+  if (dir_handle == nullptr) {
+    return -1;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir_handle)) != nullptr) {
+    if (entry->d_name[0] != '.') {
+      version_dirs.push_back(root + kVersionsDir + entry->d_name);
+    }
+  }
+  closedir(dir_handle);
+
+  for (const std::string &dir : version_dirs) {
+    std::vector<stored_file_t> dir_versions = list_dir(dir);
+    if (dir_versions.empty()) {
+      // All versions of this file have been evicted.
+      unlink((dir + "/" + kPathFile).c_str());
+      rmdir(dir.c_str());
+      continue;
+    }
+    versions.insert(versions.end(), dir_versions.begin(), dir_versions.end());
+  }
+
+  off_t total = 0;
+  for (const stored_file_t &version : versions) {
+    inode_info_t &info = inodes[version.ino];
+    if (info.links == 0) {
+      info.size = version.size;
+      total += info.size;
+    }
+    ++info.links;
+  }
+  for (const stored_file_t &object : list_dir(root + kObjectsDir)) {
+    auto iter = inodes.find(object.ino);
+    if (iter == inodes.end()) {
+      // No version refers to this object anymore.
+      unlink(object.name.c_str());
+    } else {
+      ++iter->second.links;
+      iter->second.object_name = object.name;
+    }
+  }
+
+  off_t budget = static_cast<off_t>(option.backup_store_size) * 1024 * 1024;
+  if (total <= budget) {
+    return total;
+  }
+
+  std::sort(versions.begin(), versions.end(),
+            [](const stored_file_t &a, const stored_file_t &b) { return a.stamp < b.stamp; });
+  for (const stored_file_t &version : versions) {
+    if (total <= budget) {
+      break;
+    }
+    if (version.name == keep || unlink(version.name.c_str()) < 0) {
+      continue;
+    }
+    lprintf("Evicted backup version %s\n", version.name.c_str());
+    auto iter = inodes.find(version.ino);
+    if (iter == inodes.end()) {
+      continue;
+    }
+    inode_info_t &info = iter->second;
+    --info.links;
+    if (info.links == 1 && !info.object_name.empty()) {
+      unlink(info.object_name.c_str());
+      info.links = 0;
+    }
+    if (info.links == 0) {
+      total -= info.size;
+    }
+  }
+  return total;
+}
+
+/* Returns the size recorded in the size file open as @p fd, or -1 if the store must be scanned.
+   @p scan_time is set to the time the recorded size was counted. */
+off_t read_store_size(int fd, time_t *scan_time) {
+  char buffer[64];
+  ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+  if (length <= 0) {
+    return -1;
+  }
+  buffer[length] = 0;
+  long long total, counted;
+  if (sscanf(buffer, "%lld %lld", &total, &counted) != 2 || total < 0) {
+    return -1;
+  }
+  time_t now = time(nullptr);
+  if (counted > now || now - counted > kRescanInterval) {
+    return -1;
+  }
+  *scan_time = counted;
+  return total;
+}
+
+void write_store_size(int fd, off_t total, time_t scan_time) {
+  char buffer[64];
+  int length = snprintf(buffer, sizeof(buffer), "%lld %lld\n", static_cast<long long>(total),
+                        static_cast<long long>(scan_time));
+  if (ftruncate(fd, 0) < 0 || pwrite(fd, buffer, length, 0) != length) {
+    lprintf("Could not update backup store size: %s\n", strerror(errno));
+  }
+}
+
+/* Account for @p added bytes stored and @p removed bytes freed, and remove the oldest versions in
+   the store if it no longer fits in the budget. The store is only scanned when it does not fit,
+   or when the recorded size is missing or out of date. */
+void enforce_budget(const std::string &root, const std::string &keep, off_t added,
+                    off_t removed) {
+  std::string size_file = root + kSizeFile;
+  int fd = open(size_file.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    lprintf("Could not open backup store size: %s\n", strerror(errno));
+    scan_and_evict(root, keep);
+    return;
+  }
+  // Other instances may be saving into the store as well.
+  struct flock flock;
+  flock.l_len = 1;
+  flock.l_start = 0;
+  flock.l_whence = SEEK_SET;
+  flock.l_type = F_WRLCK;
+  while (fcntl(fd, F_SETLKW, &flock) != 0) {
+    if (errno != EINTR) {
+      lprintf("Could not lock backup store size: %s\n", strerror(errno));
+      break;
+    }
+  }
+
+  off_t budget = static_cast<off_t>(option.backup_store_size) * 1024 * 1024;
+  time_t scan_time;
+  off_t total = read_store_size(fd, &scan_time);
+  if (total >= 0) {
+    total += added - removed;
+    if (total >= 0 && total <= budget) {
+      write_store_size(fd, total, scan_time);
+      close(fd);
+      return;
+    }
+  }
+  scan_time = time(nullptr);
+  total = scan_and_evict(root, keep);
+  if (total >= 0) {
+    write_store_size(fd, total, scan_time);
+  }
+  close(fd);
+}
+
+}  // namespace
+
+int store_backup_version(int fd, const std::string &path, std::string *version_name) {
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) {
+    return errno;
+  }
+  if (statbuf.st_size > static_cast<off_t>(option.backup_store_size) * 1024 * 1024) {
+    return EFBIG;
+  }
+
+  std::string root = store_root();
+  if (root.empty()) {
+    return ENOENT;
+  }
+  fnv_hash_t path_hash;
+  path_hash.update(path.data(), path.size());
+  std::string version_dir = root + kVersionsDir + path_hash.hex();
+  std::string objects_dir = root + kObjectsDir;
+  if (!make_dirs(version_dir) || !make_dirs(objects_dir)) {
+    return errno;
+  }
+  record_path(version_dir, path);
+
+  std::string temp_name = version_dir + "/.tmp-XXXXXX";
+  std::vector<char> temp_name_buffer(temp_name.begin(), temp_name.end());
+  temp_name_buffer.push_back(0);
+  int temp_fd = mkstemp(temp_name_buffer.data());
+  if (temp_fd < 0) {
+    return errno;
+  }
+  temp_name = temp_name_buffer.data();
+
+  std::string name = version_dir + "/" + version_stamp();
+  off_t added = 0;
+  int result = copy_file_by_ficlone(fd, temp_fd);
+  if (result == 0) {
+    if ((result = finish_temp(&temp_fd, temp_name, name)) == 0) {
+      added = allocated_size(name);
+    }
+  } else {
+    result = store_object(fd, objects_dir, &temp_fd, temp_name, name, &added);
+  }
+  if (temp_fd >= 0) {
+    close(temp_fd);
+  }
+  // If the contents were linked or renamed into place, this fails harmlessly.
+  unlink(temp_name.c_str());
+  if (result != 0) {
+    lprintf("Could not store backup version of %s: %s\n", path.c_str(), strerror(result));
+    return result;
+  }
+  sync_dir(version_dir);
+  *version_name = name;
+
+  std::unique_lock<std::mutex> guard(store_lock);
+  off_t removed =
+      limit_versions(version_dir, objects_dir, std::max<size_t>(option.backup_versions, 1));
+  enforce_budget(root, name, added, removed);
+  return 0;
+}
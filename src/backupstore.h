@@ -0,0 +1,22 @@
+#ifndef BACKUPSTORE_H_
+#define BACKUPSTORE_H_
+
+#include <string>
+
+/** Store the current contents of the file open as @p fd as the newest version of @p path.
+
+    The backup store lives in $XDG_CACHE_HOME/tilde/backups, and holds the last
+    option.backup_versions versions of each file. A version is created as a reflink where the file
+    system supports it. Elsewhere the contents are stored once per distinct content, and each
+    version is a hard link to the stored contents. Versions are evicted oldest first when the
+    store grows beyond option.backup_store_size MiB.
+
+    The stored version is synced to disk before returning, such that it can serve as the backup
+    while the file is overwritten.
+
+    @param version_name Set to the name of the stored version on success.
+    @return 0 on success, or an @c errno value.
+*/
+int store_backup_version(int fd, const std::string &path, std::string *version_name);
+
+#endif
@@ -0,0 +1,269 @@
+#include "tilde/batchsave.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "tilde/backupstore.h"
+#include "tilde/copy_file.h"
+#include "tilde/filebuffer.h"
+#include "tilde/log.h"
+#include "tilde/option.h"
+#include "tilde/parallelencode.h"
+#include "tilde/worker_pool.h"
+
+batch_save_t::batch_save_t(file_buffer_t *_file) : file(_file) {}
+
+batch_save_t::~batch_save_t() {
+  if (backup_fd >= 0) {
+    close(backup_fd);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  // The temporary backup is only useful if the original file may have been damaged.
+  if (temp_backup && !backup_name.empty() && !original_modified) {
+    unlink(backup_name.c_str());
+  }
+  if (conversion_handle) {
+    transcript_close_converter(conversion_handle);
+  }
+}
+
+rw_result_t batch_save_t::prepare() {
+  if (file->get_strip_spaces()) {
+    file->do_strip_spaces();
+  }
+
+  if (strcmp(file->get_encoding(), "UTF-8") != 0) {
+    transcript_error_t error;
+    if ((conversion_handle = transcript_open_converter(file->get_encoding(), TRANSCRIPT_UTF8, 0,
+                                                       &error)) == nullptr) {
+      return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+    }
+  }
+
+  real_name = canonicalize_path(file->get_name().c_str());
+  if (real_name.empty()) {
+    if (errno != ENOENT) {
+      return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, errno);
+    }
+    real_name = file->get_name();
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+static rw_result_t write_allow_imprecise(file_write_wrapper_t *wrapper, const char *buffer,
+                                         size_t bytes, bool *imprecise) {
+  try {
+    wrapper->write(buffer, bytes);
+  } catch (rw_result_t error) {
+    // An imprecise conversion still converts the whole buffer, using fallbacks where needed.
+    if (error != rw_result_t::CONVERSION_IMPRECISE) {
+      return error;
+    }
+    *imprecise = true;
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+rw_result_t batch_save_t::encode() {
+  file_write_wrapper_t wrapper(&data, conversion_handle);
+  rw_result_t result(rw_result_t::SUCCESS, 0);
+
+  data.clear();
+  if (conversion_handle != nullptr && can_encode_in_parallel(file, file->get_encoding())) {
+    std::vector<std::string> blocks;
+    if ((result = encode_in_parallel(file, file->get_encoding(), &blocks, &imprecise)) !=
+        rw_result_t::SUCCESS) {
+      return result;
+    }
+    for (const std::string &block : blocks) {
+      data.append(block);
+    }
+    return result;
+  }
+  for (text_pos_t i = 0; i < file->size(); i++) {
+    if (i != 0 &&
+        (result = write_allow_imprecise(&wrapper, "\n", 1, &imprecise)) != rw_result_t::SUCCESS) {
+      return result;
+    }
+    const std::string &line = file->get_line_data(i).get_data();
+    if ((result = write_allow_imprecise(&wrapper, line.data(), line.size(), &imprecise)) !=
+        rw_result_t::SUCCESS) {
+      return result;
+    }
+  }
+  return result;
+}
+
+void batch_save_t::fall_back_to_interactive() {
+  interactive = true;
+  if (backup_fd >= 0) {
+    close(backup_fd);
+    backup_fd = -1;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (temp_backup && !backup_name.empty()) {
+    unlink(backup_name.c_str());
+    backup_name.clear();
+  }
+  backup_saved = false;
+}
+
+void batch_save_t::open_and_backup() {
+  if ((fd = open(real_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666)) >= 0) {
+    // A newly created file has no contents to back up.
+    return;
+  }
+  // Read-only files and other problems need the user to decide what to do.
+  if ((fd = open(real_name.c_str(), O_RDWR)) < 0) {
+    fall_back_to_interactive();
+    return;
+  }
+
+  if (option.backup_versions > 0 && store_backup_version(fd, real_name, &backup_name) == 0) {
+    backup_saved = true;
+    return;
+  }
+
+  if (option.make_backup) {
+    backup_name = real_name + "~";
+    backup_fd = open(backup_name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  } else {
+    size_t idx = real_name.rfind('/');
+    std::string temp_name_str = real_name.substr(0, idx == std::string::npos ? 0 : idx + 1);
+    temp_name_str.append("tilde-backup-XXXXXX");
+    std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+    temp_name.push_back(0);
+    if ((backup_fd = mkstemp(temp_name.data())) >= 0) {
+      backup_name = temp_name.data();
+      temp_backup = true;
+    }
+  }
+
+  if (backup_fd < 0 || copy_file(fd, backup_fd) != 0) {
+    fall_back_to_interactive();
+  }
+}
+
+void batch_save_t::backup_synced(int sync_error) {
+  if (interactive || backup_fd < 0) {
+    return;
+  }
+  if (sync_error != 0 || close(backup_fd) < 0) {
+    fall_back_to_interactive();
+    return;
+  }
+  backup_fd = -1;
+  backup_saved = true;
+}
+
+rw_result_t batch_save_t::write() {
+  if (interactive) {
+    return rw_result_t(rw_result_t::SUCCESS, 0);
+  }
+#ifdef HAS_POSIX_FALLOCATE
+  int fallocate_error = posix_fallocate(fd, 0, data.size());
+  if (fallocate_error == ENOSPC || fallocate_error == EFBIG) {
+    close(fd);
+    fd = -1;
+    return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, fallocate_error);
+  }
+#endif
+  original_modified = true;
+  if (lseek(fd, 0, SEEK_SET) < 0 || nosig_write(fd, data.data(), data.size()) < 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  int result;
+  while ((result = ftruncate(fd, data.size())) < 0 && errno == EINTR) {
+  }
+  if (result < 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  return rw_result_t(rw_result_t::SUCCESS, 0);
+}
+
+rw_result_t batch_save_t::finish(int sync_error) {
+  if (interactive) {
+    return rw_result_t(rw_result_t::SUCCESS, 0);
+  }
+  if (sync_error != 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, sync_error);
+  }
+  if (close(fd) < 0) {
+    fd = -1;
+    return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  fd = -1;
+  original_modified = false;
+  file->set_undo_mark();
+  return rw_result_t(rw_result_t::SUCCESS, 0);
+}
+
+#if defined(HAS_SYNCFS) && defined(__linux__)
+static bool syncfs_reports_errors() {
+  static const bool result = [] {
+    struct utsname name;
+    int major, minor;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2) {
+      return false;
+    }
+    return major > 5 || (major == 5 && minor >= 8);
+  }();
+  return result;
+}
+
+static int sync_file_system(int fd) { return syncfs(fd); }
+#else
+static bool syncfs_reports_errors() { return false; }
+
+static int sync_file_system(int) {
+  errno = ENOTSUP;
+  return -1;
+}
+#endif
+
+void sync_files(const std::vector<int> &fds, std::vector<int> *errors) {
+  std::map<dev_t, std::vector<size_t>> by_device;
+  std::vector<size_t> individual;
+
+  errors->assign(fds.size(), 0);
+  for (size_t i = 0; i < fds.size(); ++i) {
+    struct stat statbuf;
+    if (fds[i] < 0) {
+      continue;
+    }
+    if (fstat(fds[i], &statbuf) < 0) {
+      individual.push_back(i);
+    } else {
+      by_device[statbuf.st_dev].push_back(i);
+    }
+  }
+
+  bool use_syncfs = syncfs_reports_errors();
+  for (const auto &device : by_device) {
+    if (use_syncfs && device.second.size() > 1) {
+      if (sync_file_system(fds[device.second.front()]) == 0) {
+        lprintf("Synced %zd files with a single syncfs\n", device.second.size());
+        continue;
+      }
+      lprintf("syncfs failed, falling back to fsync: %s\n", strerror(errno));
+    }
+    individual.insert(individual.end(), device.second.begin(), device.second.end());
+  }
+
+  worker_pool.run_parallel(individual.size(), [&fds, &individual, errors](size_t i) {
+    if (fsync(fds[individual[i]]) < 0) {
+      (*errors)[individual[i]] = errno;
+    }
+  });
+}
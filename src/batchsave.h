@@ -0,0 +1,78 @@
+#ifndef BATCHSAVE_H_
+#define BATCHSAVE_H_
+
+#include <string>
+#include <transcript/transcript.h>
+#include <vector>
+
+#include "tilde/filestate.h"
+
+class file_buffer_t;
+
+/** Non-interactive save of a single file_buffer_t, used when saving many files at once.
+
+    Saving is split into phases, such that the expensive parts can be run concurrently for many
+    files on worker threads:
+    - prepare: strips trailing spaces and opens the converter. Must run on the main thread.
+    - encode: converts the buffer contents into the on-disk representation.
+    - open_and_backup: opens the file and copies its current contents to the backup file.
+    - backup_synced: closes the backup after the caller has flushed it to disk.
+    - write: overwrites the file with the encoded contents.
+    - finish: closes the file after the caller has flushed it to disk. Must run on the main thread.
+    The file_buffer_t must not be modified between prepare and finish. None of the phases sync
+    data to disk, such that the caller can group the syncs for all files (see sync_files).
+
+    Anything out of the ordinary that happens before the file is modified, such as a read-only
+    file or a failure to create the backup, abandons the save and marks it as requiring an
+    interactive save instead. That way all questions to the user are handled by save_process_t.
+*/
+class batch_save_t {
+ public:
+  explicit batch_save_t(file_buffer_t *_file);
+  ~batch_save_t();
+
+  rw_result_t prepare();
+  rw_result_t encode();
+  void open_and_backup();
+  void backup_synced(int sync_error);
+  rw_result_t write();
+  rw_result_t finish(int sync_error);
+
+  file_buffer_t *get_file() const { return file; }
+  /** Returns whether encode had to use fallbacks, i.e. the saved file will differ. */
+  bool is_imprecise() const { return imprecise; }
+  bool needs_interactive_save() const { return interactive; }
+  bool is_backup_saved() const { return backup_saved; }
+  const std::string &get_backup_name() const { return backup_name; }
+  int get_fd() const { return fd; }
+  int get_backup_fd() const { return backup_fd; }
+
+ private:
+  void fall_back_to_interactive();
+
+  file_buffer_t *file;
+  std::string real_name;
+  std::string backup_name;
+  bool temp_backup = false;
+  transcript_t *conversion_handle = nullptr;
+  std::string data;
+  int fd = -1;
+  int backup_fd = -1;
+  bool imprecise = false;
+  bool interactive = false;
+  bool backup_saved = false;
+  bool original_modified = false;
+};
+
+/** Flush the data of all files in @p fds to disk.
+
+    Rather than calling fsync for every file, a single syncfs call is made for each file system
+    that holds more than one of the files. This is only done if syncfs reports write-back errors
+    on this system (Linux 5.8 and later), and falls back to fsync for each file on error to find
+    out which files were affected. Negative file descriptors are skipped.
+
+    @param errors Filled with the @c errno value for each file descriptor in @p fds, or 0.
+*/
+void sync_files(const std::vector<int> &fds, std::vector<int> *errors);
+
+#endif
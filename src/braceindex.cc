@@ -0,0 +1,275 @@
+#include "tilde/braceindex.h"
+
+#include <algorithm>
+
+void brace_summary_t::add(bool open) {
+  sum += open ? 1 : -1;
+  min_prefix = std::min(min_prefix, sum);
+  max_suffix = std::max(0, max_suffix + (open ? 1 : -1));
+}
+
+brace_summary_t brace_summary_t::combine(const brace_summary_t &a, const brace_summary_t &b) {
+  brace_summary_t result;
+  result.sum = a.sum + b.sum;
+  result.min_prefix = std::min(a.min_prefix, a.sum + b.min_prefix);
+  result.max_suffix = std::max(b.max_suffix, b.sum + a.max_suffix);
+  return result;
+}
+
+int brace_index_t::get_kind(char c) {
+  switch (c) {
+    case '(':
+    case ')':
+      return 0;
+    case '[':
+    case ']':
+      return 1;
+    case '{':
+    case '}':
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+void brace_index_t::reset(text_pos_t line_count) { root = build(line_count); }
+
+text_pos_t brace_index_t::size() const { return get_size(root); }
+
+void brace_index_t::insert_lines(text_pos_t first, text_pos_t last) {
+  if (first > size()) {
+    return;
+  }
+  node_ptr_t left, right;
+  split(std::move(root), first, &left, &right);
+  root = merge(merge(std::move(left), build(last - first)), std::move(right));
+}
+
+void brace_index_t::erase_lines(text_pos_t first, text_pos_t last) {
+  if (last > size()) {
+    return;
+  }
+  node_ptr_t left, middle, right;
+  split(std::move(root), first, &left, &right);
+  split(std::move(right), last - first, &middle, &right);
+  root = merge(std::move(left), std::move(right));
+}
+
+void brace_index_t::invalidate_line(text_pos_t line) {
+  if (!is_valid(line)) {
+    return;
+  }
+  set_line_node(root.get(), line, nullptr);
+}
+
+bool brace_index_t::is_valid(text_pos_t line) const {
+  return line >= 0 && line < size() && find_line(line)->valid;
+}
+
+text_pos_t brace_index_t::find_invalid(text_pos_t first, text_pos_t last) const {
+  return find_invalid_node(root.get(), 0, first, std::min(last, size()));
+}
+
+void brace_index_t::set_line(text_pos_t line, const brace_summary_t (&summaries)[kinds]) {
+  if (line < 0 || line >= size()) {
+    return;
+  }
+  set_line_node(root.get(), line, &summaries);
+}
+
+const brace_summary_t &brace_index_t::get_summary(text_pos_t line, int kind) const {
+  return find_line(line)->line_summaries[kind];
+}
+
+text_pos_t brace_index_t::get_size(const node_ptr_t &node) { return node ? node->size : 0; }
+
+void brace_index_t::update_node(node_t *node) {
+  node->size = 1;
+  node->invalid = node->valid ? 0 : 1;
+  std::copy(node->line_summaries, node->line_summaries + kinds, node->summaries);
+  if (node->left) {
+    node->size += node->left->size;
+    node->invalid += node->left->invalid;
+    for (int kind = 0; kind < kinds; ++kind) {
+      node->summaries[kind] =
+          brace_summary_t::combine(node->left->summaries[kind], node->summaries[kind]);
+    }
+  }
+  if (node->right) {
+    node->size += node->right->size;
+    node->invalid += node->right->invalid;
+    for (int kind = 0; kind < kinds; ++kind) {
+      node->summaries[kind] =
+          brace_summary_t::combine(node->summaries[kind], node->right->summaries[kind]);
+    }
+  }
+}
+
+// Builds a perfectly balanced tree of invalid lines.
+brace_index_t::node_ptr_t brace_index_t::build(text_pos_t line_count) {
+  if (line_count <= 0) {
+    return nullptr;
+  }
+  node_ptr_t node(new node_t());
+  node->left = build(line_count / 2);
+  node->right = build(line_count - line_count / 2 - 1);
+  update_node(node.get());
+  return node;
+}
+
+// Splits the tree into the first @p count lines and the rest.
+void brace_index_t::split(node_ptr_t node, text_pos_t count, node_ptr_t *left,
+                          node_ptr_t *right) {
+  if (!node) {
+    left->reset();
+    right->reset();
+    return;
+  }
+  if (get_size(node->left) >= count) {
+    node_ptr_t rest;
+    split(std::move(node->left), count, left, &rest);
+    node->left = std::move(rest);
+    update_node(node.get());
+    *right = std::move(node);
+  } else {
+    node_ptr_t rest;
+    split(std::move(node->right), count - get_size(node->left) - 1, &rest, right);
+    node->right = std::move(rest);
+    update_node(node.get());
+    *left = std::move(node);
+  }
+}
+
+/* The root of either tree becomes the root of the result, with a probability proportional to the
+   size of the tree. If the trees are random binary search trees, so is the result. */
+brace_index_t::node_ptr_t brace_index_t::merge(node_ptr_t left, node_ptr_t right) {
+  if (!left) {
+    return right;
+  }
+  if (!right) {
+    return left;
+  }
+  std::uniform_int_distribution<text_pos_t> pick(0, left->size + right->size - 1);
+  if (pick(random) < left->size) {
+    left->right = merge(std::move(left->right), std::move(right));
+    update_node(left.get());
+    return left;
+  }
+  right->left = merge(std::move(left), std::move(right->left));
+  update_node(right.get());
+  return right;
+}
+
+const brace_index_t::node_t *brace_index_t::find_line(text_pos_t line) const {
+  const node_t *node = root.get();
+  while (true) {
+    text_pos_t left_size = get_size(node->left);
+    if (line < left_size) {
+      node = node->left.get();
+    } else if (line == left_size) {
+      return node;
+    } else {
+      line -= left_size + 1;
+      node = node->right.get();
+    }
+  }
+}
+
+// Sets the summaries of @p line, relative to @p node, or invalidates them if @p summaries is null.
+void brace_index_t::set_line_node(node_t *node, text_pos_t line,
+                                  const brace_summary_t (*summaries)[kinds]) {
+  text_pos_t left_size = get_size(node->left);
+  if (line < left_size) {
+    set_line_node(node->left.get(), line, summaries);
+  } else if (line > left_size) {
+    set_line_node(node->right.get(), line - left_size - 1, summaries);
+  } else if (summaries == nullptr) {
+    node->valid = false;
+    std::fill(node->line_summaries, node->line_summaries + kinds, brace_summary_t());
+  } else {
+    node->valid = true;
+    std::copy(*summaries, *summaries + kinds, node->line_summaries);
+  }
+  update_node(node);
+}
+
+/* The searches below visit the nodes in the order of their lines, where node_first is the first
+   line in the subtree of node. Subtrees that are completely inside the range are skipped in one
+   step if they can not contain the line searched for. Thus only O(log n) nodes are visited. */
+text_pos_t brace_index_t::find_invalid_node(const node_t *node, text_pos_t node_first,
+                                            text_pos_t first, text_pos_t last) {
+  if (node == nullptr || node->invalid == 0 || node_first + node->size <= first ||
+      node_first >= last) {
+    return -1;
+  }
+  text_pos_t line = node_first + get_size(node->left);
+  text_pos_t result = find_invalid_node(node->left.get(), node_first, first, last);
+  if (result >= 0) {
+    return result;
+  }
+  if (!node->valid && line >= first && line < last) {
+    return line;
+  }
+  return find_invalid_node(node->right.get(), line + 1, first, last);
+}
+
+text_pos_t brace_index_t::find_forward(int kind, text_pos_t first, text_pos_t last,
+                                       int *depth) const {
+  return find_forward_node(root.get(), 0, kind, first, std::min(last, size()), depth);
+}
+
+text_pos_t brace_index_t::find_backward(int kind, text_pos_t first, text_pos_t last,
+                                        int *need) const {
+  return find_backward_node(root.get(), 0, kind, first, std::min(last, size()), need);
+}
+
+text_pos_t brace_index_t::find_forward_node(const node_t *node, text_pos_t node_first, int kind,
+                                            text_pos_t first, text_pos_t last, int *depth) {
+  if (node == nullptr || node_first + node->size <= first || node_first >= last) {
+    return -1;
+  }
+  const brace_summary_t &summary = node->summaries[kind];
+  if (first <= node_first && node_first + node->size <= last &&
+      *depth + summary.min_prefix > 0) {
+    *depth += summary.sum;
+    return -1;
+  }
+  text_pos_t line = node_first + get_size(node->left);
+  text_pos_t result = find_forward_node(node->left.get(), node_first, kind, first, last, depth);
+  if (result >= 0) {
+    return result;
+  }
+  if (line >= first && line < last) {
+    const brace_summary_t &line_summary = node->line_summaries[kind];
+    if (*depth + line_summary.min_prefix <= 0) {
+      return line;
+    }
+    *depth += line_summary.sum;
+  }
+  return find_forward_node(node->right.get(), line + 1, kind, first, last, depth);
+}
+
+text_pos_t brace_index_t::find_backward_node(const node_t *node, text_pos_t node_first, int kind,
+                                             text_pos_t first, text_pos_t last, int *need) {
+  if (node == nullptr || node_first + node->size <= first || node_first >= last) {
+    return -1;
+  }
+  const brace_summary_t &summary = node->summaries[kind];
+  if (first <= node_first && node_first + node->size <= last && summary.max_suffix < *need) {
+    *need -= summary.sum;
+    return -1;
+  }
+  text_pos_t line = node_first + get_size(node->left);
+  text_pos_t result = find_backward_node(node->right.get(), line + 1, kind, first, last, need);
+  if (result >= 0) {
+    return result;
+  }
+  if (line >= first && line < last) {
+    const brace_summary_t &line_summary = node->line_summaries[kind];
+    if (line_summary.max_suffix >= *need) {
+      return line;
+    }
+    *need -= line_summary.sum;
+  }
+  return find_backward_node(node->left.get(), node_first, kind, first, last, need);
+}
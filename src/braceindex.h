@@ -0,0 +1,112 @@
+#ifndef BRACEINDEX_H_
+#define BRACEINDEX_H_
+
+#include <memory>
+#include <random>
+#include <t3widget/util.h>
+
+using namespace t3widget;
+
+/** The braces of one kind in a single line or a range of lines, counting an opening brace as +1
+    and a closing brace as -1. */
+struct brace_summary_t {
+  // The total count.
+  int sum = 0;
+  // The lowest count reached at any point, starting from 0. Thus never positive.
+  int min_prefix = 0;
+  // The highest count of any suffix, i.e. counting backward from the end. Thus never negative.
+  int max_suffix = 0;
+
+  /** Account for a single brace after the braces summarized so far. */
+  void add(bool open);
+  /** Combine the summaries of two consecutive ranges. */
+  static brace_summary_t combine(const brace_summary_t &a, const brace_summary_t &b);
+};
+
+/** Brace counts per line, to find the line of a matching brace without scanning each line.
+
+    For each line the summaries of the three kinds of braces, (), [] and {}, are stored. Braces in
+    highlighted text are not counted by the caller, thus the summaries of a line must be
+    invalidated when its text or its highlighting start state changes. The lines are kept in a
+    balanced binary tree, in which each node holds the summaries of its subtree. This way the line
+    where the count reaches a given value can be found in logarithmic time, and so can the lines
+    of which the summaries are not known. Inserting and deleting lines takes logarithmic time as
+    well, plus the time for the lines themselves.
+*/
+class brace_index_t {
+ public:
+  static const int kinds = 3;
+
+  /** Returns the kind of brace @p c, or -1 if @p c is not a brace. */
+  static int get_kind(char c);
+
+  /** Forget all summaries, and set the number of lines to @p line_count. */
+  void reset(text_pos_t line_count);
+  text_pos_t size() const;
+  /** Lines [@p first, @p last) were inserted. */
+  void insert_lines(text_pos_t first, text_pos_t last);
+  /** Lines [@p first, @p last) were deleted. */
+  void erase_lines(text_pos_t first, text_pos_t last);
+  void invalidate_line(text_pos_t line);
+
+  /** Returns whether the summaries of @p line are known. */
+  bool is_valid(text_pos_t line) const;
+  /** Returns the first line in [@p first, @p last) of which the summaries are not known, or -1 if
+      there is no such line. */
+  text_pos_t find_invalid(text_pos_t first, text_pos_t last) const;
+  void set_line(text_pos_t line, const brace_summary_t (&summaries)[kinds]);
+  const brace_summary_t &get_summary(text_pos_t line, int kind) const;
+
+  /** Find the first line in [@p first, @p last) in which the count reaches 0, when it is @p depth
+      at the start of @p first. All lines in the range must be valid.
+
+      @param depth The count at the start of @p first. Set to the count at the start of the
+          returned line, or at @p last if there is no such line.
+      @return The line, or -1 if there is no such line.
+  */
+  text_pos_t find_forward(int kind, text_pos_t first, text_pos_t last, int *depth) const;
+  /** Find the last line in [@p first, @p last) with enough surplus opening braces to match
+      @p need unmatched closing braces after it. All lines in the range must be valid.
+
+      @param need The number of unmatched closing braces at the end of @p last - 1. Set to the
+          number at the end of the returned line, or at the start of @p first if there is no such
+          line.
+      @return The line, or -1 if there is no such line.
+  */
+  text_pos_t find_backward(int kind, text_pos_t first, text_pos_t last, int *need) const;
+
+ private:
+  /* A node holds one line, with the lines before it in its left subtree and the lines after it in
+     its right subtree. Invalid lines have empty summaries. */
+  struct node_t {
+    bool valid = false;
+    brace_summary_t line_summaries[kinds];
+    // The summaries, number of lines and number of invalid lines of the subtree.
+    brace_summary_t summaries[kinds];
+    text_pos_t size = 1;
+    text_pos_t invalid = 1;
+    std::unique_ptr<node_t> left, right;
+  };
+  using node_ptr_t = std::unique_ptr<node_t>;
+
+  static text_pos_t get_size(const node_ptr_t &node);
+  static void update_node(node_t *node);
+  static node_ptr_t build(text_pos_t line_count);
+  static void split(node_ptr_t node, text_pos_t count, node_ptr_t *left, node_ptr_t *right);
+  node_ptr_t merge(node_ptr_t left, node_ptr_t right);
+  const node_t *find_line(text_pos_t line) const;
+  static void set_line_node(node_t *node, text_pos_t line,
+                            const brace_summary_t (*summaries)[kinds]);
+  static text_pos_t find_invalid_node(const node_t *node, text_pos_t node_first,
+                                      text_pos_t first, text_pos_t last);
+  static text_pos_t find_forward_node(const node_t *node, text_pos_t node_first, int kind,
+                                      text_pos_t first, text_pos_t last, int *depth);
+  static text_pos_t find_backward_node(const node_t *node, text_pos_t node_first, int kind,
+                                       text_pos_t first, text_pos_t last, int *need);
+
+  node_ptr_t root;
+  // Used by merge to pick the root, which keeps the tree balanced in expectation.
+  std::minstd_rand random;
+};
+
+#endif
@@ -4,82 +4,129 @@
 
 #include "tilde/copy_file.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <limits>
+#include <map>
+#include <mutex>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <t3widget/util.h>
 #include <unistd.h>
+#include <utility>
 
-using namespace t3widget;
+#include "tilde/log.h"
 
-static bool rewind_files(int src_fd, int dest_fd) {
-  if (lseek(src_fd, 0, SEEK_SET) == (off_t)-1) {
-    return false;
-  }
-  if (lseek(dest_fd, 0, SEEK_SET) == (off_t)-1) {
-    return false;
-  }
-  return true;
-}
+/* The copy_range_by_* functions copy @p length bytes starting at @p offset in the source file to
+   the same offset in the destination file. If the end of the source file is reached first, for
+   example because the file shrank since its size was determined, they stop and report success.
+   @p copied is set to the number of bytes actually copied. */
 
 #if defined(HAS_SENDFILE) && defined(__linux__)
 #include <sys/sendfile.h>
 
-int copy_file_by_sendfile(int src_fd, int dest_fd, size_t bytes_to_copy) {
-  if (!rewind_files(src_fd, dest_fd)) {
+static int copy_range_by_sendfile(int src_fd, int dest_fd, off_t offset, size_t length,
+                                  size_t *copied) {
+  *copied = 0;
+  if (lseek(dest_fd, offset, SEEK_SET) == (off_t)-1) {
     return errno;
   }
 
-  ssize_t result;
-  do {
-    result = sendfile(dest_fd, src_fd, nullptr, bytes_to_copy);
+  while (*copied < length) {
+    ssize_t result = sendfile(dest_fd, src_fd, &offset, length - *copied);
     if (result < 0) {
-      if (errno == EAGAIN) {
+      if (errno == EAGAIN || errno == EINTR) {
         continue;
       }
-    }
-    if (result < 0) {
       return errno;
+    } else if (result == 0) {
+      break;
     }
-    bytes_to_copy -= result;
-  } while (bytes_to_copy > 0);
+    *copied += result;
+  }
   return 0;
 }
 #else
 #if defined(TILDE_UNITTEST) && defined(__linux__)
 #error Please define HAS_SENDFILE in unit tests
 #endif
-int copy_file_by_sendfile(int, int, size_t) { return ENOTSUP; }
+static int copy_range_by_sendfile(int, int, off_t, size_t, size_t *copied) {
+  *copied = 0;
+  return ENOTSUP;
+}
 #endif
 
 #if defined(HAS_COPY_FILE_RANGE)
-int copy_file_by_copy_file_range(int src_fd, int dest_fd, size_t bytes_to_copy) {
-  if (!rewind_files(src_fd, dest_fd)) {
-    return errno;
-  }
-
-  ssize_t result;
-  do {
-    result = copy_file_range(src_fd, nullptr, dest_fd, nullptr, bytes_to_copy, 0);
+static int copy_range_by_copy_file_range(int src_fd, int dest_fd, off_t offset, size_t length,
+                                         size_t *copied) {
+  off_t dest_offset = offset;
+  *copied = 0;
+  while (*copied < length) {
+    ssize_t result =
+        copy_file_range(src_fd, &offset, dest_fd, &dest_offset, length - *copied, 0);
     if (result < 0) {
-      if (errno == EAGAIN) {
+      if (errno == EAGAIN || errno == EINTR) {
         continue;
       }
-    }
-    if (result < 0) {
       return errno;
+    } else if (result == 0) {
+      break;
     }
-    bytes_to_copy -= result;
-  } while (bytes_to_copy > 0);
+    *copied += result;
+  }
   return 0;
 }
 #else
 #if defined(TILDE_UNITTEST) && defined(__linux__)
 #error Please define HAS_COPY_FILE_RANGE in unit tests
 #endif
-int copy_file_by_copy_file_range(int, int, size_t) { return ENOTSUP; }
+static int copy_range_by_copy_file_range(int, int, off_t, size_t, size_t *copied) {
+  *copied = 0;
+  return ENOTSUP;
+}
 #endif
 
+static int copy_range_by_read_write(int src_fd, int dest_fd, off_t offset, size_t length,
+                                    size_t *copied) {
+  // Copy in chunks of 32K. This aims to balance memory use vs. number of operations.
+  char buffer[32768];
+  *copied = 0;
+  while (*copied < length) {
+    ssize_t read_bytes = pread(src_fd, buffer, std::min(sizeof(buffer), length - *copied), offset);
+    if (read_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    } else if (read_bytes == 0) {
+      break;
+    }
+
+    for (ssize_t written = 0; written < read_bytes;) {
+      ssize_t result = pwrite(dest_fd, buffer + written, read_bytes - written, offset + written);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      written += result;
+    }
+    offset += read_bytes;
+    *copied += read_bytes;
+  }
+  return 0;
+}
+
+int copy_file_by_sendfile(int src_fd, int dest_fd, size_t bytes_to_copy) {
+  size_t copied;
+  return copy_range_by_sendfile(src_fd, dest_fd, 0, bytes_to_copy, &copied);
+}
+
+int copy_file_by_copy_file_range(int src_fd, int dest_fd, size_t bytes_to_copy) {
+  size_t copied;
+  return copy_range_by_copy_file_range(src_fd, dest_fd, 0, bytes_to_copy, &copied);
+}
+
 #if defined(HAS_FICLONE)
 #include <linux/fs.h>
 #include <sys/ioctl.h>
@@ -98,46 +145,187 @@ int copy_file_by_ficlone(int, int) { return ENOTSUP; }
 #endif
 
 int copy_file_by_read_write(int src_fd, int dest_fd) {
-  if (!rewind_files(src_fd, dest_fd)) {
-    return errno;
+  size_t copied;
+  return copy_range_by_read_write(src_fd, dest_fd, 0, std::numeric_limits<size_t>::max(), &copied);
+}
+
+namespace {
+
+/* For each combination of source and destination device, the first strategy that is worth trying.
+   Whether a strategy is supported depends on both file systems (e.g. copy_file_range and FICLONE
+   fail with EXDEV for copies across file systems), so the key includes both. As copy_file may be
+   called from worker threads, all accesses are guarded by the mutex. */
+using device_pair_t = std::pair<dev_t, dev_t>;
+std::map<device_pair_t, copy_strategy_t> strategy_cache;
+copy_file_cache_stats_t cache_stats;
+std::mutex cache_lock;
+
+#ifdef DEBUG
+const char *strategy_name(copy_strategy_t strategy) {
+  switch (strategy) {
+    case copy_strategy_t::BY_FICLONE:
+      return "FICLONE";
+    case copy_strategy_t::BY_COPY_FILE_RANGE:
+      return "copy_file_range";
+    case copy_strategy_t::BY_SENDFILE:
+      return "sendfile";
+    case copy_strategy_t::BY_READ_WRITE:
+      return "read/write";
   }
-  // Copy in chunks of 32K. This aims to balance memory use vs. number of operations.
-  char buffer[32768];
-  while (true) {
-    ssize_t read_bytes = nosig_read(src_fd, buffer, sizeof(buffer));
-    if (read_bytes < 0) {
-      return errno;
-    } else if (read_bytes == 0) {
-      return 0;
-    }
+  return "unknown";
+}
+#endif
 
-    ssize_t written_bytes = nosig_write(dest_fd, buffer, read_bytes);
-    if (written_bytes < 0) {
-      return errno;
-    }
+// Returns whether @p error indicates that the strategy can not be used on these file systems.
+bool is_unsupported_error(int error) {
+  return error == ENOTSUP || error == EXDEV || error == ENOSYS || error == EINVAL;
+}
+
+// Returns whether a previous copy between @p devices succeeded, and if so which strategy it used.
+bool lookup_strategy(const device_pair_t &devices, copy_strategy_t *strategy) {
+  std::unique_lock<std::mutex> guard(cache_lock);
+  auto iter = strategy_cache.find(devices);
+  if (iter == strategy_cache.end()) {
+    return false;
   }
+  *strategy = iter->second;
+  return true;
 }
 
-int copy_file(int src_fd, int dest_fd) {
+void store_strategy(const device_pair_t &devices, copy_strategy_t strategy) {
+  std::unique_lock<std::mutex> guard(cache_lock);
+  strategy_cache[devices] = strategy;
+  lprintf("copy_file: using %s for copies from device %lx to %lx (cache hits %zd, misses %zd)\n",
+          strategy_name(strategy), static_cast<unsigned long>(devices.first),
+          static_cast<unsigned long>(devices.second), cache_stats.hits, cache_stats.misses);
+}
+
+int copy_range_by_strategy(copy_strategy_t strategy, int src_fd, int dest_fd, off_t offset,
+                           size_t length, size_t *copied) {
+  switch (strategy) {
+    case copy_strategy_t::BY_COPY_FILE_RANGE:
+      return copy_range_by_copy_file_range(src_fd, dest_fd, offset, length, copied);
+    case copy_strategy_t::BY_SENDFILE:
+      return copy_range_by_sendfile(src_fd, dest_fd, offset, length, copied);
+    case copy_strategy_t::BY_READ_WRITE:
+      return copy_range_by_read_write(src_fd, dest_fd, offset, length, copied);
+    default:
+      return EINVAL;
+  }
+}
+
+/* Copy only the data extents of the source file, leaving holes in the destination where the
+   source has holes. The copy is bounded by @p size, as well as by the size of the source file
+   at the end of the copy, such that a file that shrinks while copying does not result in a
+   longer backup. */
+int copy_data_extents(copy_strategy_t strategy, int src_fd, int dest_fd, off_t size) {
   int result;
+  while ((result = ftruncate(dest_fd, 0)) < 0 && errno == EINTR) {
+  }
+  if (result < 0) {
+    return errno;
+  }
 
-  result = copy_file_by_ficlone(src_fd, dest_fd);
-  if (result == 0) {
-    return result;
+  off_t offset = 0;
+  while (offset < size) {
+    off_t data_start = offset;
+    off_t data_end = size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    data_start = lseek(src_fd, offset, SEEK_DATA);
+    if (data_start == (off_t)-1) {
+      // ENXIO means there is no more data after offset.
+      if (errno == ENXIO) {
+        break;
+      }
+      // Treat the remainder of the file as data if the file system can not find holes.
+      if (errno != EINVAL) {
+        return errno;
+      }
+      data_start = offset;
+    } else if ((data_end = lseek(src_fd, data_start, SEEK_HOLE)) == (off_t)-1) {
+      return errno;
+    }
+#endif
+    if (data_start >= size) {
+      break;
+    }
+    data_end = std::min(data_end, size);
+
+    size_t copied;
+    result = copy_range_by_strategy(strategy, src_fd, dest_fd, data_start,
+                                    data_end - data_start, &copied);
+    if (result != 0) {
+      return result;
+    }
+    if (copied < static_cast<size_t>(data_end - data_start)) {
+      // The end of the file was reached early, so the file has shrunk.
+      size = data_start + copied;
+      break;
+    }
+    offset = data_end;
   }
 
   struct stat statbuf;
   if (fstat(src_fd, &statbuf) < 0) {
     return errno;
   }
-  // FIXME: these routines may fail if the file changed in between and are now shorter!
-  result = copy_file_by_copy_file_range(src_fd, dest_fd, statbuf.st_size);
-  if (result != ENOTSUP) {
-    return result;
+  size = std::min(size, statbuf.st_size);
+  // Setting the size creates the trailing hole, if the source file ends in one.
+  while ((result = ftruncate(dest_fd, size)) < 0 && errno == EINTR) {
+  }
+  if (result < 0) {
+    return errno;
+  }
+  return 0;
+}
+
+}  // namespace
+
+int copy_file(int src_fd, int dest_fd) {
+  struct stat src_statbuf, dest_statbuf;
+  if (fstat(src_fd, &src_statbuf) < 0 || fstat(dest_fd, &dest_statbuf) < 0) {
+    return errno;
+  }
+
+  device_pair_t devices(src_statbuf.st_dev, dest_statbuf.st_dev);
+  copy_strategy_t strategy = copy_strategy_t::BY_FICLONE;
+  bool cached = lookup_strategy(devices, &strategy);
+  {
+    std::unique_lock<std::mutex> guard(cache_lock);
+    ++(cached ? cache_stats.hits : cache_stats.misses);
+  }
+  copy_strategy_t cached_strategy = strategy;
+  while (true) {
+    int result = strategy == copy_strategy_t::BY_FICLONE
+                     ? copy_file_by_ficlone(src_fd, dest_fd)
+                     : copy_data_extents(strategy, src_fd, dest_fd, src_statbuf.st_size);
+    // The read/write method is the last resort, so its errors are always returned.
+    if (strategy == copy_strategy_t::BY_READ_WRITE || !is_unsupported_error(result)) {
+      if (result == 0 && (!cached || strategy != cached_strategy)) {
+        store_strategy(devices, strategy);
+      }
+      return result;
+    }
+    strategy = static_cast<copy_strategy_t>(static_cast<int>(strategy) + 1);
   }
-  result = copy_file_by_sendfile(src_fd, dest_fd, statbuf.st_size);
-  if (result != ENOTSUP) {
-    return result;
+}
+
+copy_strategy_t get_copy_file_strategy(int src_fd, int dest_fd) {
+  copy_strategy_t strategy = copy_strategy_t::BY_FICLONE;
+  struct stat src_statbuf, dest_statbuf;
+  if (fstat(src_fd, &src_statbuf) == 0 && fstat(dest_fd, &dest_statbuf) == 0) {
+    lookup_strategy(device_pair_t(src_statbuf.st_dev, dest_statbuf.st_dev), &strategy);
   }
-  return copy_file_by_read_write(src_fd, dest_fd);
+  return strategy;
+}
+
+copy_file_cache_stats_t get_copy_file_cache_stats() {
+  std::unique_lock<std::mutex> guard(cache_lock);
+  return cache_stats;
+}
+
+void clear_copy_file_cache() {
+  std::unique_lock<std::mutex> guard(cache_lock);
+  strategy_cache.clear();
+  cache_stats = copy_file_cache_stats_t{0, 0};
 }
@@ -10,7 +10,26 @@ int copy_file_by_copy_file_range(int src_fd, int dest_fd, size_t bytes_to_copy);
 int copy_file_by_ficlone(int src_fd, int dest_fd);
 int copy_file_by_read_write(int src_fd, int dest_fd);
 
-// Generic copy routine which will try to copy the file using one of the methods above.
+// The methods used by copy_file, in the order in which they are tried.
+enum class copy_strategy_t { BY_FICLONE, BY_COPY_FILE_RANGE, BY_SENDFILE, BY_READ_WRITE };
+
+// Generic copy routine which will try to copy the file using one of the methods above. Methods
+// that turn out not to be supported for a combination of source and destination file system are
+// remembered, such that subsequent copies between the same file systems skip them. Except when
+// cloning, only the data extents of the source are copied, such that holes are preserved.
 int copy_file(int src_fd, int dest_fd);
 
+// Returns the first method copy_file will try for copying between the given files.
+copy_strategy_t get_copy_file_strategy(int src_fd, int dest_fd);
+
+struct copy_file_cache_stats_t {
+  size_t hits;
+  size_t misses;
+};
+
+// Returns the number of times copy_file could (not) use a previous result for the file systems.
+copy_file_cache_stats_t get_copy_file_cache_stats();
+// Forget all previous results and reset the statistics.
+void clear_copy_file_cache();
+
 #endif
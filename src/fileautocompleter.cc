@@ -11,11 +11,43 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "tilde/fileautocompleter.h"
+#include "tilde/filebuffer.h"
 #include "tilde/log.h"
+#include "tilde/openfiles.h"
+#include "tilde/projectindex.h"
+
+// The number of lines before and after the cursor to take words from, if the index is not built.
+static const text_pos_t nearby_lines = 1000;
+// The maximum number of words taken from the project index.
+static const size_t max_project_words = 1000;
+
+static void add_nearby_words(const text_buffer_t *text, text_pos_t center, string_view prefix,
+                             std::set<std::string> *words) {
+  text_pos_t last = std::min(text->size(), center + nearby_lines + 1);
+  for (text_pos_t i = std::max<text_pos_t>(0, center - nearby_lines); i < last; ++i) {
+    const text_line_t &line = text->get_line_data(i);
+    for (text_pos_t pos = 0; pos < line.size();) {
+      if (!line.is_alnum(pos)) {
+        pos = line.adjust_position(pos, 1);
+        continue;
+      }
+      text_pos_t start = pos;
+      while (pos < line.size() && line.is_alnum(pos)) {
+        pos = line.adjust_position(pos, 1);
+      }
+      string_view word = string_view(line.get_data()).substr(start, pos - start);
+      if (word.size() >= prefix.size() && word.substr(0, prefix.size()) == prefix) {
+        words->insert(std::string(word));
+      }
+    }
+  }
+}
 
 string_list_base_t *file_autocompleter_t::build_autocomplete_list(const text_buffer_t *text,
                                                                   t3widget::text_pos_t *position) {
@@ -49,35 +81,65 @@ string_list_base_t *file_autocompleter_t::build_autocomplete_list(const text_buf
   string_view current_word =
       string_view(line.get_data()).substr(completion_start, completion_end - completion_start);
 
-  text_coordinate_t start(0, 0);
-  text_coordinate_t eof(std::numeric_limits<text_pos_t>::max(),
-                        std::numeric_limits<text_pos_t>::max());
-  std::string needle(line.get_data(), completion_start, cursor.pos - completion_start);
-  std::unique_ptr<finder_t> finder =
-      finder_t::create(needle, find_flags_t::ANCHOR_WORD_LEFT, nullptr);
-  find_result_t find_result;
-  std::set<string_view> result_set;
-
-  while (text->find_limited(finder.get(), start, eof, &find_result)) {
-    const text_line_t &matching_line = text->get_line_data(find_result.start.line);
-    for (;
-         find_result.end.pos < matching_line.size() && matching_line.is_alnum(find_result.end.pos);
-         find_result.end.pos = matching_line.adjust_position(find_result.end.pos, 1)) {
+  string_view needle = current_word.substr(0, cursor.pos - completion_start);
+  if (needle.empty()) {
+    return nullptr;
+  }
+  /* The word indexes are built on worker threads, so completion never has to scan a whole file.
+     Until the index of the current file is available, only the lines around the cursor are
+     used. The words from the other open files are offered after those from the current file,
+     and files of which the index is not available yet are skipped. Words from the other files
+     in the project directory come last. The indexes are built in the background after the
+     files are loaded, see schedule_word_index_build. */
+  std::vector<string_view> words;
+  std::set<std::string> nearby_words;
+  file_buffer_t *current_file = nullptr;
+  for (file_buffer_t *file : open_files) {
+    if (file == text) {
+      current_file = file;
+    }
+  }
+  if (current_file == nullptr || !current_file->find_indexed_words(needle, &words)) {
+    add_nearby_words(text, cursor.line, needle, &nearby_words);
+    for (const std::string &word : nearby_words) {
+      words.push_back(string_view(word));
+    }
+  }
+
+  std::vector<string_view> candidates;
+  for (string_view word : words) {
+    if (word.size() != needle.size() && word != current_word) {
+      candidates.push_back(word);
     }
+  }
 
-    if (find_result.end.pos - find_result.start.pos != cursor.pos - completion_start) {
-      string_view word(matching_line.get_data());
-      word = word.substr(find_result.start.pos, find_result.end.pos - find_result.start.pos);
-      if (word != current_word) {
-        result_set.insert(word);
+  std::set<string_view> seen(candidates.begin(), candidates.end());
+  std::set<string_view> other_words;
+  for (file_buffer_t *file : open_files) {
+    if (file == text) {
+      continue;
+    }
+    words.clear();
+    file->find_indexed_words(needle, &words);
+    for (string_view word : words) {
+      if (word.size() != needle.size() && word != current_word && seen.count(word) == 0) {
+        other_words.insert(word);
       }
     }
-
-    start.line = find_result.end.line;
-    start.pos = find_result.end.pos;
+  }
+  candidates.insert(candidates.end(), other_words.begin(), other_words.end());
+
+  std::vector<std::string> project_words;
+  find_project_words(needle, max_project_words, &project_words);
+  seen.insert(other_words.begin(), other_words.end());
+  for (const std::string &word : project_words) {
+    string_view word_view(word);
+    if (word.size() != needle.size() && word_view != current_word && seen.count(word_view) == 0) {
+      candidates.push_back(word_view);
+    }
   }
 
-  if (result_set.empty()) {
+  if (candidates.empty()) {
     return nullptr;
   }
 
@@ -87,7 +149,7 @@ string_list_base_t *file_autocompleter_t::build_autocomplete_list(const text_buf
     return nullptr;
   }
 
-  for (string_view word : result_set) {
+  for (string_view word : candidates) {
     current_list->push_back(std::string(word));
   }
   *position = completion_start;
@@ -11,28 +11,39 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <vector>
 
+#include "tilde/backgroundhighlight.h"
+#include "tilde/backgroundwordindex.h"
+#include "tilde/backupstore.h"
 #include "tilde/copy_file.h"
 #include "tilde/filebuffer.h"
 #include "tilde/fileline.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightcache.h"
+#include "tilde/highlightcheckpoints.h"
 #include "tilde/log.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
+#include "tilde/parallelencode.h"
+#include "tilde/util.h"
+#include "tilde/worker_pool.h"
 
 #define CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
 file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
     : text_buffer_t(new file_line_factory_t(this)),
       behavior_parameters(new edit_window_t::behavior_parameters_t()),
-      has_window(false),
-      highlight_valid(0),
+      window_count(0),
+      paint_line(-1),
+      checkpoint_first(-1),
+      checkpoint_last(-1),
       highlight_info(nullptr),
-      match_line(nullptr),
-      last_match(nullptr),
+      paint_cursor(&default_cursor),
       matching_brace_valid(false) {
   if (_encoding.size() == 0) {
     encoding = "UTF-8";
@@ -50,6 +61,7 @@ file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
   }
 
   connect_rewrap_required(bind_front(&file_buffer_t::invalidate_highlight, this));
+  connect_rewrap_required(bind_front(&file_buffer_t::invalidate_word_index, this));
 
   behavior_parameters->set_tabsize(option.tabsize);
   behavior_parameters->set_wrap(option.wrap ? wrap_type_t::WORD : wrap_type_t::NONE);
@@ -58,12 +70,18 @@ file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
   behavior_parameters->set_indent_aware_home(option.indent_aware_home);
   behavior_parameters->set_show_tabs(option.show_tabs);
   open_files.push_back(this);
+  // Named files are indexed once they have been loaded.
+  if (name.empty()) {
+    schedule_word_index_build(this);
+  }
 }
 
 file_buffer_t::~file_buffer_t() {
+  cancel_background_highlight(this);
+  cancel_word_index_build(this);
   open_files.erase(this);
-  t3_highlight_free(highlight_info);
-  t3_highlight_free_match(last_match);
+  save_checkpoints();
+  release_shared_highlight(highlight_info);
   delete get_line_factory();
 }
 
@@ -166,6 +184,13 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
       PANIC();
   }
 
+  schedule_word_index_build(this);
+
+  if (load_recent_language()) {
+    language_detected = true;
+    return rw_result_t(rw_result_t::SUCCESS);
+  }
+
   /* Automatically load appropriate highlighting patterns if available.
      Try the following in order:
      - a vi(m) modeline/Emacs major mode spec in the first five lines
@@ -196,25 +221,74 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
     success = t3_highlight_lang_by_filename(name.c_str(), T3_HIGHLIGHT_UTF8, &lang, nullptr);
   }
   if (success) {
-    highlight = t3_highlight_load(lang.lang_file, map_highlight, nullptr,
-                                  T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH
-/* If T3_HIGHLIGHT_USE_SCOPE is not available, all the other code is still compatible, so we simply
-   omit the flag here. */
-#ifdef T3_HIGHLIGHT_USE_SCOPE
-                                      | T3_HIGHLIGHT_USE_SCOPE
-#endif
-                                  ,
-                                  nullptr);
-    set_highlight(highlight);
+    highlight = load_shared_highlight(lang.lang_file, kHighlightLoadFlags, nullptr);
+    set_highlight(highlight, lang.name);
+    load_checkpoints();
     std::map<std::string, std::string>::iterator iter = option.line_comment_map.find(lang.name);
     if (iter != option.line_comment_map.end()) {
       set_line_comment(iter->second.c_str());
     }
     t3_highlight_free_lang(lang);
   }
+  language_detected = true;
   return rw_result_t(rw_result_t::SUCCESS);
 }
 
+bool file_buffer_t::load_recent_language() {
+  auto recent_iter = recent_files.find(name);
+  if (recent_iter == recent_files.end()) {
+    return false;
+  }
+  const recent_file_info_t *info = recent_iter->get();
+  if (info->get_detection_key().empty() || info->get_detection_key() != get_detection_key()) {
+    return false;
+  }
+
+  if (!info->get_language_file().empty()) {
+    t3_highlight_t *highlight =
+        load_shared_highlight(info->get_language_file().c_str(), kHighlightLoadFlags, nullptr);
+    // The language file may have been removed since. Detecting the language again is our best bet.
+    if (highlight == nullptr) {
+      return false;
+    }
+    set_highlight(highlight, info->get_language().c_str());
+    load_checkpoints();
+  }
+  set_line_comment(info->get_line_comment().empty() ? nullptr : info->get_line_comment().c_str());
+  lprintf("Reused language '%s' for %s\n", info->get_language().c_str(), name.c_str());
+  return true;
+}
+
+std::string file_buffer_t::get_detection_key() const {
+  fnv_hash_t hash;
+  std::string count = std::to_string(size());
+  hash.update(name.data(), name.size() + 1);
+  hash.update(count.data(), count.size() + 1);
+  for (text_pos_t i = 0; i < size(); ++i) {
+    // Only the lines in which a modeline is expected are taken into account.
+    if (i == 5 && size() > 10) {
+      i = size() - 5;
+    }
+    const std::string &line = get_line_data(i).get_data();
+    hash.update(line.data(), line.size());
+    hash.update("\n", 1);
+  }
+  // Changes to the language files or the language map may change the detected language.
+  std::string fingerprint = get_lang_dirs_fingerprint(get_lang_search_path(), nullptr);
+  hash.update(fingerprint.data(), fingerprint.size() + 1);
+  for (const std::pair<const std::string, std::string> &line_comment : option.line_comment_map) {
+    hash.update(line_comment.first.data(), line_comment.first.size() + 1);
+    hash.update(line_comment.second.data(), line_comment.second.size() + 1);
+  }
+  return hash.hex();
+}
+
+const std::string &file_buffer_t::get_language() const { return language; }
+
+bool file_buffer_t::get_language_detected() const { return language_detected; }
+
+const std::string &file_buffer_t::get_line_comment() const { return line_comment; }
+
 /* FIXME: try to prevent as many race conditions as possible here. */
 rw_result_t file_buffer_t::save(save_as_process_t *state) {
   size_t idx;
@@ -252,6 +326,22 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
     case save_as_process_t::OPEN_FILE: {
       if (state->conversion_handle) {
         transcript_from_unicode_reset(state->conversion_handle);
+        if (state->i == 0 && can_encode_in_parallel(this, encoding.c_str())) {
+          bool imprecise;
+          rw_result_t result =
+              encode_in_parallel(this, encoding.c_str(), &state->encoded_blocks, &imprecise);
+          if (result != rw_result_t::SUCCESS) {
+            return result;
+          }
+          state->i = size();
+          state->computed_length = 0;
+          for (const std::string &block : state->encoded_blocks) {
+            state->computed_length += block.size();
+          }
+          if (imprecise) {
+            return rw_result_t(rw_result_t::CONVERSION_IMPRECISE);
+          }
+        }
       }
       try {
         for (; state->i < size(); state->i++) {
@@ -267,7 +357,9 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       } catch (rw_result_t error) {
         return error;
       }
-      state->computed_length = state->wrapper->written_size();
+      if (state->encoded_blocks.empty()) {
+        state->computed_length = state->wrapper->written_size();
+      }
 
       if (state->name.empty()) {
         if (name.empty()) {
@@ -340,50 +432,56 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       // If the creation of the backup file fails, the user either aborts or allows continuation
       // without completing the backup. Thus the next state is always WRITING.
       state->state = save_as_process_t::WRITING;
-      std::string temp_name_str = state->real_name;
-
-      if (option.make_backup) {
-        temp_name_str += "~";
-        if ((state->backup_fd = open(temp_name_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) <
-            0) {
-          return rw_result_t(rw_result_t::BACKUP_FAILED, errno);
-        }
+      // A version in the backup store is synced to disk as well, so it can serve as the backup.
+      if (option.backup_versions > 0 &&
+          store_backup_version(state->fd, state->real_name, &state->version_name) == 0) {
+        state->backup_saved = true;
       } else {
-        if ((idx = temp_name_str.rfind('/')) == std::string::npos) {
-          idx = 0;
+        std::string temp_name_str = state->real_name;
+
+        if (option.make_backup) {
+          temp_name_str += "~";
+          if ((state->backup_fd =
+                   open(temp_name_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0) {
+            return rw_result_t(rw_result_t::BACKUP_FAILED, errno);
+          }
         } else {
-          idx++;
-        }
+          if ((idx = temp_name_str.rfind('/')) == std::string::npos) {
+            idx = 0;
+          } else {
+            idx++;
+          }
 
-        temp_name_str.erase(idx);
-        temp_name_str.append("tilde-backup-XXXXXX");
+          temp_name_str.erase(idx);
+          temp_name_str.append("tilde-backup-XXXXXX");
 
-        /* Unfortunately, we can't pass the c_str result to mkstemp as we are not allowed to change
-           that string. So we'll just have to copy it into a vector :-( */
-        std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
-        // Ensure nul termination.
-        temp_name.push_back(0);
-        if ((state->backup_fd = mkstemp(temp_name.data())) >= 0) {
-          state->temp_name = temp_name.data();
-        } else {
+          /* Unfortunately, we can't pass the c_str result to mkstemp as we are not allowed to
+             change that string. So we'll just have to copy it into a vector :-( */
+          std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+          // Ensure nul termination.
+          temp_name.push_back(0);
+          if ((state->backup_fd = mkstemp(temp_name.data())) >= 0) {
+            state->temp_name = temp_name.data();
+          } else {
+            return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
+                                               : rw_result_t::BACKUP_FAILED,
+                               errno);
+          }
+        }
+        int error = copy_file(state->fd, state->backup_fd);
+        if (error != 0) {
+          return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
+                                             : rw_result_t::BACKUP_FAILED,
+                             error);
+        }
+        if (fsync(state->backup_fd) < 0 || close(state->backup_fd) < 0) {
           return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
                                              : rw_result_t::BACKUP_FAILED,
                              errno);
         }
+        state->backup_saved = true;
+        state->backup_fd = -1;
       }
-      int error = copy_file(state->fd, state->backup_fd);
-      if (error != 0) {
-        return rw_result_t(
-            errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
-            error);
-      }
-      if (fsync(state->backup_fd) < 0 || close(state->backup_fd) < 0) {
-        return rw_result_t(
-            errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
-            errno);
-      }
-      state->backup_saved = true;
-      state->backup_fd = -1;
     }
       // FALLTHROUGH
     case save_as_process_t::WRITING: {
@@ -408,28 +506,40 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       if (lseek(state->fd, 0, SEEK_SET) < 0) {
         return rw_result_t(rw_result_t::ERRNO_ERROR);
       }
-      try {
-        for (; state->i < size(); state->i++) {
-          if (state->i != 0) {
-            state->wrapper->write("\n", 1);
+      off_t written_size = 0;
+      if (!state->encoded_blocks.empty()) {
+        // The text was already converted in OPEN_FILE, so only the writing remains.
+        for (const std::string &block : state->encoded_blocks) {
+          if (nosig_write(state->fd, block.data(), block.size()) < 0) {
+            return rw_result_t(rw_result_t::ERRNO_ERROR);
           }
-          const std::string &data = get_line_data(state->i).get_data();
-          state->wrapper->write(data.data(), data.size());
+          written_size += block.size();
         }
-      } catch (rw_result_t error) {
-        // Don't attempt to retry imprecise conversions, as they should have been caught earlier.
-        // Also, restarting the conversion may append the current line to an already partially
-        // written line.
-        if (error == rw_result_t::CONVERSION_IMPRECISE) {
-          return rw_result_t(rw_result_t::CONVERSION_ERROR);
+        state->encoded_blocks.clear();
+      } else {
+        try {
+          for (; state->i < size(); state->i++) {
+            if (state->i != 0) {
+              state->wrapper->write("\n", 1);
+            }
+            const std::string &data = get_line_data(state->i).get_data();
+            state->wrapper->write(data.data(), data.size());
+          }
+        } catch (rw_result_t error) {
+          // Don't attempt to retry imprecise conversions, as they should have been caught
+          // earlier. Also, restarting the conversion may append the current line to an already
+          // partially written line.
+          if (error == rw_result_t::CONVERSION_IMPRECISE) {
+            return rw_result_t(rw_result_t::CONVERSION_ERROR);
+          }
+          return error;
         }
-        return error;
+        written_size = state->wrapper->written_size();
       }
 
       // Truncate it to the written size.
       int result;
-      while ((result = ftruncate(state->fd, state->wrapper->written_size())) < 0 &&
-             errno == EINTR) {
+      while ((result = ftruncate(state->fd, written_size)) < 0 && errno == EINTR) {
       }
       if (result < 0) {
         return rw_result_t(rw_result_t::ERRNO_ERROR);
@@ -478,51 +588,371 @@ const edit_window_t::behavior_parameters_t *file_buffer_t::get_behavior_paramete
   return behavior_parameters.get();
 }
 
+/* The minimum number of lines for which prepare_paint_line computes the start states on
+   multiple threads. */
+static const text_pos_t parallel_highlight_lines = 16384;
+/* The maximum number of lines for which update_matching_brace computes the brace counts, before
+   leaving the rest of the search to the next update. */
+static const text_pos_t brace_search_budget = 2048;
+
 void file_buffer_t::prepare_paint_line(text_pos_t line) {
+  paint_line = line;
+  prepare_highlight_states(line);
+
+  paint_line_data = line < size() ? &get_line_data(line) : nullptr;
+  paint_state = -1;
+  if (highlight_info != nullptr && line < static_cast<text_pos_t>(highlight_states.size())) {
+    paint_state = highlight_states[line];
+  }
+  paint_brace_pos = matching_brace_valid && matching_brace_coordinate.line == line
+                        ? matching_brace_coordinate.pos
+                        : -1;
+  if (paint_palette_version != option.highlights.get_version() ||
+      paint_palette_brace != option.brace_highlight) {
+    update_paint_palette(paint_palette_normal);
+  }
+}
+
+void file_buffer_t::update_paint_palette(t3_attr_t normal_attr) {
+  paint_palette_version = option.highlights.get_version();
+  paint_palette_normal = normal_attr;
+  paint_palette_brace = option.brace_highlight;
+  paint_palette.clear();
+  for (int idx = -1; idx < 0 || option.highlights.lookup_attributes(idx).is_valid(); ++idx) {
+    t3_attr_t attr = option.highlights.lookup_attributes(idx).value_or(normal_attr);
+    paint_palette.push_back(attr);
+    paint_palette.push_back(t3_term_combine_attrs(attr, paint_palette_brace));
+  }
+}
+
+void file_buffer_t::prepare_highlight_states(text_pos_t line) {
+  if (highlight_info == nullptr) {
+    return;
+  }
+  check_highlight_states();
+  if (highlight_progress.valid >= line || prepare_paint_line_from_checkpoint(line)) {
+    return;
+  }
+
+  highlight_progress.update(
+      line, size(),
+      [this](text_pos_t i) { return set_highlight_start(i, get_highlight_end(i - 1)); },
+      [this, line](text_pos_t i) {
+        if (line - i < parallel_highlight_lines || worker_pool.get_max_threads() <= 1) {
+          return false;
+        }
+        propagate_highlight_parallel(i, line);
+        return true;
+      });
+}
+
+/* Computes the start states up to line from the closest preceding checkpoint, if that is after
+   highlight_progress.valid. Returns false if there is no such checkpoint. */
+bool file_buffer_t::prepare_paint_line_from_checkpoint(text_pos_t line) {
+  if (checkpoint_first >= 0 && line >= checkpoint_first && line <= checkpoint_last) {
+    return true;
+  }
+  auto iter = std::upper_bound(highlight_checkpoints.begin(), highlight_checkpoints.end(), line);
+  if (iter == highlight_checkpoints.begin() || *(iter - 1) <= highlight_progress.valid + 1) {
+    return false;
+  }
+
+  text_pos_t checkpoint = *(iter - 1);
   text_pos_t i;
+  if (checkpoint_first >= 0 && checkpoint >= checkpoint_first &&
+      checkpoint <= checkpoint_last + 1) {
+    i = checkpoint_last + 1;
+  } else {
+    checkpoint_first = checkpoint;
+    i = checkpoint + 1;
+  }
+  for (; i <= line; i++) {
+    set_highlight_start(i, get_highlight_end(i - 1));
+  }
+  checkpoint_last = line;
+  return true;
+}
+
+void file_buffer_t::load_checkpoints() {
+  highlight_checkpoints.clear();
+  checkpoint_first = checkpoint_last = -1;
+  for (const highlight_checkpoint_t &checkpoint : load_highlight_checkpoints(this)) {
+    set_highlight_start(checkpoint.line, checkpoint.state);
+    highlight_checkpoints.push_back(checkpoint.line);
+  }
+}
 
-  if (highlight_info == nullptr || highlight_valid >= line) {
+void file_buffer_t::save_checkpoints() {
+  if (highlight_info == nullptr || static_cast<text_pos_t>(highlight_states.size()) != size()) {
     return;
   }
+  std::vector<highlight_checkpoint_t> checkpoints;
+  for (text_pos_t line = highlight_checkpoint_interval; line < size();
+       line += highlight_checkpoint_interval) {
+    if (line <= highlight_progress.valid ||
+        (line >= checkpoint_first && line <= checkpoint_last) ||
+        std::binary_search(highlight_checkpoints.begin(), highlight_checkpoints.end(), line)) {
+      checkpoints.push_back(highlight_checkpoint_t{line, highlight_states[line]});
+    }
+  }
+  save_highlight_checkpoints(this, checkpoints);
+}
+
+/* Computes the start states of lines first through last, given that the start state of line
+   first - 1 is correct. The lines are split into ranges, one per thread. All but the first range
+   are computed with a guessed start state. The guesses are then checked in order: if the state at
+   the end of the previous range differs from the guess, the range is recomputed from its start
+   until the recomputed start states match the guessed ones again. For most languages this happens
+   within a few lines. */
+void file_buffer_t::propagate_highlight_parallel(text_pos_t first, text_pos_t last) {
+  size_t ranges = worker_pool.get_max_threads();
+  text_pos_t range_size = (last - first) / static_cast<text_pos_t>(ranges) + 1;
+  std::vector<int> states(last - first + 1);
+  std::vector<int> range_end_states(ranges);
+  int first_state = get_highlight_end(first - 1);
+
+  // The ranges only read the lines of this buffer, which run_parallel allows.
+  worker_pool.run_parallel(ranges, [&](size_t range) {
+    highlight_cursor_t cursor;
+    text_pos_t range_first = first + static_cast<text_pos_t>(range) * range_size;
+    text_pos_t range_last = std::min(last, range_first + range_size - 1);
+    int state = range == 0 ? first_state : 0;
+    for (text_pos_t i = range_first; i <= range_last; ++i) {
+      states[i - first] = state;
+      state = static_cast<const file_line_t &>(get_line_data(i)).compute_highlight_end(state,
+                                                                                   &cursor);
+    }
+    range_end_states[range] = state;
+  });
+
+  int state = range_end_states[0];
+  for (size_t range = 1; range < ranges; ++range) {
+    text_pos_t range_first = first + static_cast<text_pos_t>(range) * range_size;
+    text_pos_t range_last = std::min(last, range_first + range_size - 1);
+    if (range_first > last) {
+      break;
+    }
+    text_pos_t i;
+    for (i = range_first; i <= range_last && states[i - first] != state; ++i) {
+      states[i - first] = state;
+      state = static_cast<const file_line_t &>(get_line_data(i)).compute_highlight_end(
+          state, &state_cursor);
+    }
+    if (i <= range_last) {
+      lprintf("Highlight state converged after %ld lines\n", static_cast<long>(i - range_first));
+      state = range_end_states[range];
+    }
+  }
+
+  for (text_pos_t i = first; i <= last; ++i) {
+    set_highlight_start(i, states[i - first]);
+  }
+}
 
-  for (i = highlight_valid >= 0 ? highlight_valid + 1 : 1; i <= line; i++) {
-    int state = static_cast<file_line_t *>(get_mutable_line_data(i - 1))->get_highlight_end();
-    static_cast<file_line_t *>(get_mutable_line_data(i))->set_highlight_start(state);
+/* highlight_states follows the insertion and deletion of lines in invalidate_highlight. Should it
+   be out of step with the buffer anyway, all start states are computed again. */
+void file_buffer_t::check_highlight_states() {
+  if (static_cast<text_pos_t>(highlight_states.size()) == size()) {
+    return;
   }
-  highlight_valid = line;
-  match_line = nullptr;
+  lprintf("Highlight states out of step with buffer, resetting\n");
+  highlight_states.assign(size(), 0);
+  highlight_progress.reset();
+  highlight_checkpoints.clear();
+  checkpoint_first = checkpoint_last = -1;
+  brace_index.reset(size());
 }
 
-void file_buffer_t::set_has_window(bool _has_window) { has_window = _has_window; }
+bool file_buffer_t::set_highlight_start(text_pos_t line, int state) {
+  if (highlight_states[line] == state) {
+    return false;
+  }
+  highlight_states[line] = state;
+  // The braces in highlighted text are not counted, so the counts depend on the start state.
+  brace_index.invalidate_line(line);
+  return true;
+}
 
-bool file_buffer_t::get_has_window() const { return has_window; }
+int file_buffer_t::get_highlight_end(text_pos_t line) {
+  return static_cast<const file_line_t &>(get_line_data(line))
+      .compute_highlight_end(highlight_states[line], &state_cursor);
+}
 
-void file_buffer_t::invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
-  (void)type;
-  (void)pos;
-  if (line <= highlight_valid) {
-    highlight_valid = line - 1;
+int file_buffer_t::get_highlight_idx(text_pos_t line, text_pos_t pos, highlight_cursor_t *cursor) {
+  if (highlight_info == nullptr) {
+    return -1;
   }
+  check_highlight_states();
+  return static_cast<const file_line_t &>(get_line_data(line))
+      .get_highlight_idx(pos, highlight_states[line], cursor);
 }
 
-t3_highlight_t *file_buffer_t::get_highlight() { return highlight_info; }
+void file_buffer_t::set_has_window(bool _has_window) {
+  // Several windows may show the same buffer, so count them.
+  window_count += _has_window ? 1 : -1;
+}
 
-void file_buffer_t::set_highlight(t3_highlight_t *highlight) {
+bool file_buffer_t::get_has_window() const { return window_count > 0; }
+
+void file_buffer_t::set_paint_cursor(highlight_cursor_t *cursor) {
+  paint_cursor = cursor == nullptr ? &default_cursor : cursor;
+}
+
+void file_buffer_t::invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
+  paint_line_data = nullptr;
+  ++edit_count;
+  switch (type) {
+    case rewrap_type_t::INSERT_LINES:
+      // Lines [line, pos) were inserted. The lines after them keep their start states.
+      if (!highlight_states.empty() && line <= static_cast<text_pos_t>(highlight_states.size())) {
+        highlight_states.insert(highlight_states.begin() + line, pos - line, 0);
+      }
+      brace_index.insert_lines(line, pos);
+      highlight_progress.insert_lines(line, pos);
+      break;
+    case rewrap_type_t::DELETE_LINES:
+      // Lines [line, pos) were deleted.
+      if (pos <= static_cast<text_pos_t>(highlight_states.size())) {
+        highlight_states.erase(highlight_states.begin() + line, highlight_states.begin() + pos);
+      }
+      brace_index.erase_lines(line, pos);
+      // The addresses of the deleted lines may be reused for new lines.
+      line_highlights.clear();
+      highlight_progress.erase_lines(line, pos);
+      break;
+    default:
+      brace_index.invalidate_line(line);
+      highlight_progress.change_line(line);
+      break;
+  }
+  if (line >= 0 && line < size()) {
+    line_highlights.erase(&get_line_data(line));
+  }
+  // Checkpoints after an edit no longer match the contents before them.
+  highlight_checkpoints.erase(
+      std::lower_bound(highlight_checkpoints.begin(), highlight_checkpoints.end(), line),
+      highlight_checkpoints.end());
+  if (checkpoint_last >= line) {
+    checkpoint_last = line - 1;
+    if (checkpoint_last < checkpoint_first) {
+      checkpoint_first = checkpoint_last = -1;
+    }
+  }
   if (highlight_info != nullptr) {
-    t3_highlight_free(highlight_info);
+    schedule_background_highlight(this);
   }
-  highlight_info = highlight;
+}
 
-  if (last_match != nullptr) {
-    t3_highlight_free_match(last_match);
-    last_match = nullptr;
+void file_buffer_t::invalidate_word_index(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
+  switch (type) {
+    case rewrap_type_t::INSERT_LINES:
+      word_index.insert_lines(line, pos);
+      break;
+    case rewrap_type_t::DELETE_LINES:
+      word_index.erase_lines(line, pos);
+      break;
+    default:
+      word_index.invalidate_line(line);
+      break;
   }
+}
+
+bool file_buffer_t::advance_highlight(text_pos_t max_lines) {
+  text_pos_t last_line = size() - 1;
+  if (highlight_info == nullptr || highlight_progress.valid >= last_line) {
+    return false;
+  }
+  prepare_paint_line(
+      std::min(last_line, std::max<text_pos_t>(highlight_progress.valid, 0) + max_lines));
+  return highlight_progress.valid < last_line;
+}
+
+/* Generations are unique over all buffers, such that a highlight_cursor_t that is moved to another
+   buffer never mistakes that buffer's patterns for the ones its matcher was created for. */
+static int last_highlight_generation;
+
+highlight_cursor_t::~highlight_cursor_t() {
+  if (match != nullptr) {
+    t3_highlight_free_match(match);
+  }
+}
 
-  match_line = nullptr;
-  highlight_valid = 0;
+t3_highlight_match_t *highlight_cursor_t::start_line(const file_buffer_t *file, int state) {
+  if (match_generation != file->highlight_generation) {
+    if (match != nullptr) {
+      t3_highlight_free_match(match);
+    }
+    match = t3_highlight_new_match(file->highlight_info);
+    match_generation = file->highlight_generation;
+    end_states.clear();
+  }
+  t3_highlight_reset(match, state);
+  return match;
+}
+
+// The maximum length of the lines for which highlight_cursor_t remembers the end states.
+static const size_t max_short_line_length = 48;
+// The maximum number of end states remembered by a highlight_cursor_t.
+static const size_t max_end_states = 4096;
+
+std::string highlight_cursor_t::end_state_key(int state, const std::string &line) {
+  std::string key(reinterpret_cast<const char *>(&state), sizeof(state));
+  key.append(line);
+  return key;
+}
+
+bool highlight_cursor_t::find_end_state(const file_buffer_t *file, int state,
+                                        const std::string &line, int *end_state) const {
+  if (line.size() > max_short_line_length || match_generation != file->highlight_generation) {
+    return false;
+  }
+  auto iter = end_states.find(end_state_key(state, line));
+  if (iter == end_states.end()) {
+    return false;
+  }
+  *end_state = iter->second;
+  return true;
+}
+
+void highlight_cursor_t::store_end_state(int state, const std::string &line, int end_state) {
+  if (line.size() > max_short_line_length) {
+    return;
+  }
+  if (end_states.size() >= max_end_states) {
+    end_states.clear();
+  }
+  end_states[end_state_key(state, line)] = end_state;
+}
+
+t3_highlight_t *file_buffer_t::get_highlight() { return highlight_info; }
+
+void file_buffer_t::set_highlight(t3_highlight_t *highlight, const char *language_name) {
+  release_shared_highlight(highlight_info);
+  highlight_info = highlight;
+  if (highlight_info == nullptr || language_name == nullptr) {
+    language.clear();
+  } else {
+    language = language_name;
+  }
+  language_detected = false;
+
+  highlight_progress.reset();
+  highlight_checkpoints.clear();
+  checkpoint_first = checkpoint_last = -1;
+  highlight_generation = ++last_highlight_generation;
+  line_highlights.clear();
+  // The braces in highlighted text are not counted, so the counts depend on the patterns.
+  brace_index.reset(size());
+  if (highlight_info != nullptr) {
+    highlight_states.assign(size(), 0);
+  } else {
+    std::vector<int>().swap(highlight_states);
+  }
 
   if (highlight_info != nullptr) {
-    last_match = t3_highlight_new_match(highlight_info);
+    schedule_background_highlight(this);
+  } else {
+    cancel_background_highlight(this);
   }
 }
 
@@ -591,7 +1021,79 @@ void file_buffer_t::do_strip_spaces() {
   }
 }
 
-bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
+bool file_buffer_t::update_brace_summaries(text_pos_t first, text_pos_t last, text_pos_t *budget) {
+  if (brace_index.size() != size()) {
+    brace_index.reset(size());
+  }
+  if (last <= first) {
+    return true;
+  }
+  if (budget == nullptr) {
+    prepare_paint_line(last - 1);
+  }
+  // Only the lines that need their counts computed are visited, and use up the budget.
+  text_pos_t checked = first;
+  for (text_pos_t i; (i = brace_index.find_invalid(checked, last)) >= 0; checked = i + 1) {
+    if (budget != nullptr) {
+      /* Computing the start states up to i invalidates the lines before it of which the start
+         state changed. */
+      prepare_paint_line(i);
+      i = brace_index.find_invalid(checked, i + 1);
+      if ((*budget)-- <= 0) {
+        *budget = 0;
+        return false;
+      }
+    }
+    brace_summary_t summaries[brace_index_t::kinds];
+    const std::string &data = get_line_data(i).get_data();
+    // Braces are ASCII characters, which never occur inside a UTF-8 multi-byte sequence.
+    for (text_pos_t pos = 0; pos < static_cast<text_pos_t>(data.size()); ++pos) {
+      int kind = brace_index_t::get_kind(data[pos]);
+      if (kind < 0 || get_highlight_idx(i, pos, &brace_cursor) > 0) {
+        continue;
+      }
+      summaries[kind].add(data[pos] == '(' || data[pos] == '[' || data[pos] == '{');
+    }
+    brace_index.set_line(i, summaries);
+  }
+  return true;
+}
+
+/* The summaries are computed in chunks of increasing size, such that a nearby match does not
+   require the highlighting of the rest of the file. */
+text_pos_t file_buffer_t::find_brace_line_forward(int kind, text_pos_t first, int *depth,
+                                                  text_pos_t *budget) {
+  text_pos_t chunk = 1024;
+  for (text_pos_t last; first < size(); first = last, chunk *= 2) {
+    last = std::min(size(), first + chunk);
+    if (!update_brace_summaries(first, last, budget)) {
+      return -1;
+    }
+    text_pos_t result = brace_index.find_forward(kind, first, last, depth);
+    if (result >= 0) {
+      return result;
+    }
+  }
+  return -1;
+}
+
+text_pos_t file_buffer_t::find_brace_line_backward(int kind, text_pos_t last, int *need,
+                                                   text_pos_t *budget) {
+  text_pos_t chunk = 1024;
+  for (text_pos_t first; last > 0; last = first, chunk *= 2) {
+    first = std::max<text_pos_t>(0, last - chunk);
+    if (!update_brace_summaries(first, last, budget)) {
+      return -1;
+    }
+    text_pos_t result = brace_index.find_backward(kind, first, last, need);
+    if (result >= 0) {
+      return result;
+    }
+  }
+  return -1;
+}
+
+bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location, text_pos_t *budget) {
   const text_coordinate_t cursor = get_cursor();
   file_line_t *line = static_cast<file_line_t *>(get_mutable_line_data(cursor.line));
   char c = line->get_data()[cursor.pos];
@@ -626,26 +1128,34 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
 
   prepare_paint_line(cursor.line);
   /* If the current character is highlighted, it is not considered for brace matching. */
-  if (line->get_highlight_idx(cursor.pos) > 0) {
+  if (get_highlight_idx(cursor.line, cursor.pos, &brace_cursor) > 0) {
     return false;
   }
 
+  int kind = brace_index_t::get_kind(c);
   if (forward) {
     text_pos_t current_line = cursor.line;
     text_pos_t i = cursor.pos;
     count = 0;
     /* Use goto here to jump into the loop. The reason for doing this, is
        because we want to start from the location of the cursor, not the
-       first character on the line. */
+       first character on the line. If the brace is not matched on the
+       cursor line, the brace index provides the line where the count reaches
+       zero, which is then scanned from its start. */
     goto start_search;
 
-    for (; current_line < size(); current_line++) {
+    while (true) {
+      current_line = find_brace_line_forward(kind, current_line + 1, &count, budget);
+      if (current_line < 0) {
+        return false;
+      }
       line = static_cast<file_line_t *>(get_mutable_line_data(current_line));
       prepare_paint_line(current_line);
       for (i = 0; i < line->size(); i = line->adjust_position(i, 1)) {
       start_search:
         check_c = line->get_data()[i];
-        if ((check_c != c && check_c != c_close) || line->get_highlight_idx(i) > 0) {
+        if ((check_c != c && check_c != c_close) ||
+            get_highlight_idx(current_line, i, &brace_cursor) > 0) {
           continue;
         }
 
@@ -659,6 +1169,10 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
           }
         }
       }
+      /* As a safety measure, stop if the brace index was wrong about this line. */
+      if (current_line != cursor.line) {
+        return false;
+      }
     }
   } else {
     int open_surplus = 0;
@@ -682,7 +1196,8 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
     */
     for (text_pos_t i = 0; i < cursor.pos; i = line->adjust_position(i, 1)) {
       check_c = line->get_data()[i];
-      if ((check_c != c && check_c != c_close) || line->get_highlight_idx(i) > 0) {
+      if ((check_c != c && check_c != c_close) ||
+          get_highlight_idx(current_line, i, &brace_cursor) > 0) {
         continue;
       }
 
@@ -699,43 +1214,17 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
 
     if (open_surplus == 0) {
       /* In this case, the opening brace is on a line before the current line.
-         So we have to go back, until we find the line which does have the matching
-         brace. We now calculate the open_surplus at the end of the line. If it
-         is greater than or equal to the number of closing braces we have
-         encountered (including the one we are hoping to match), the opening
-         brace we are looking for is on the current line. */
-      int local_count;
-
-      for (current_line--; current_line >= 0; current_line--) {
-        line = static_cast<file_line_t *>(get_mutable_line_data(current_line));
-        /* No need to call prepare_paint_line here because we're going backwards. */
-        text_pos_t i;
-        for (i = 0, local_count = 0, open_surplus = 0; i < line->size(); i++) {
-          check_c = line->get_data()[i];
-          if ((check_c != c && check_c != c_close) || line->get_highlight_idx(i) > 0) {
-            continue;
-          }
-
-          if (check_c == c) {
-            local_count--;
-            if (open_surplus > 0) {
-              open_surplus--;
-            }
-          } else {
-            local_count++;
-            open_surplus++;
-          }
-        }
-
-        if (open_surplus >= -count) {
-          count += local_count;
-          break;
-        }
-        count += local_count;
-      }
+         The brace index provides the last line before the current line with a
+         surplus of opening braces at its end that is at least the number of
+         closing braces we have encountered (including the one we are hoping to
+         match). */
+      int need = -count;
+      current_line = find_brace_line_backward(kind, current_line, &need, budget);
       if (current_line < 0) {
         return false;
       }
+      line = static_cast<file_line_t *>(get_mutable_line_data(current_line));
+      count = brace_index.get_summary(current_line, kind).sum - need;
       match_max = line->size();
     } else {
       match_max = cursor.pos;
@@ -755,7 +1244,8 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
     count = -count;
     for (text_pos_t i = 0; i < match_max; i = line->adjust_position(i, 1)) {
       check_c = line->get_data()[i];
-      if ((check_c != c && check_c != c_close) || line->get_highlight_idx(i) > 0) {
+      if ((check_c != c && check_c != c_close) ||
+          get_highlight_idx(current_line, i, &brace_cursor) > 0) {
         continue;
       }
 
@@ -767,7 +1257,7 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
         }
       }
     }
-    /* As a safety measure, we ensure that last_match has actually been set. */
+    /* As a safety measure, we ensure that marked_pos has actually been set. */
     if (marked_pos >= 0) {
       match_location.line = current_line;
       match_location.pos = marked_pos;
@@ -780,7 +1270,7 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
 
 bool file_buffer_t::goto_matching_brace() {
   text_coordinate_t match_coordinate;
-  if (find_matching_brace(match_coordinate)) {
+  if (find_matching_brace(match_coordinate, nullptr)) {
     set_cursor(match_coordinate);
     return true;
   }
@@ -791,7 +1281,23 @@ bool file_buffer_t::update_matching_brace() {
   bool old_valid = matching_brace_valid;
   text_coordinate_t old_coordinate = matching_brace_coordinate;
 
-  matching_brace_valid = find_matching_brace(matching_brace_coordinate);
+  if (!brace_search_pending && get_cursor() == brace_search_cursor &&
+      edit_count == brace_search_edit_count &&
+      highlight_generation == brace_search_highlight_generation) {
+    return false;
+  }
+  brace_search_cursor = get_cursor();
+  brace_search_edit_count = edit_count;
+  brace_search_highlight_generation = highlight_generation;
+
+  text_pos_t budget = brace_search_budget;
+  matching_brace_valid = find_matching_brace(matching_brace_coordinate, &budget);
+  /* The brace counts computed so far are kept, so each retry continues where the previous one
+     stopped. Ensure the main loop calls us again once it has handled any pending input. */
+  brace_search_pending = !matching_brace_valid && budget == 0;
+  if (brace_search_pending) {
+    signal_update();
+  }
 
   return old_valid != matching_brace_valid ||
          (old_valid && old_coordinate != matching_brace_coordinate);
@@ -896,6 +1402,26 @@ void file_buffer_t::toggle_line_comment() {
   }
 }
 
+bool file_buffer_t::find_indexed_words(string_view prefix, std::vector<string_view> *words) {
+  if (!word_index.is_built()) {
+    return false;
+  }
+  word_index.find_prefix(this, prefix, words);
+  return true;
+}
+
+bool file_buffer_t::copy_word_index_lines(text_pos_t count) {
+  return word_index.is_built() || word_index.copy_lines(this, count);
+}
+
+std::vector<std::string> file_buffer_t::take_word_index_copy() { return word_index.take_copy(); }
+
+void file_buffer_t::install_word_index(word_index_t &&index) {
+  if (!word_index.is_built()) {
+    word_index.install(std::move(index));
+  }
+}
+
 const char *file_buffer_t::get_char_under_cursor(size_t *size) const {
   const text_coordinate_t cursor = get_cursor();
   const text_line_t &line = get_line_data(cursor.line);
@@ -911,6 +1437,26 @@ const char *file_buffer_t::get_char_under_cursor(size_t *size) const {
   return line.get_data().data() + cursor.pos;
 }
 
+std::string file_buffer_t::get_word_under_cursor() const {
+  const text_coordinate_t cursor = get_cursor();
+  const text_line_t &line = get_line_data(cursor.line);
+  text_pos_t start = std::min(cursor.pos, line.size());
+  if ((start == line.size() || !line.is_alnum(start)) && start > 0) {
+    start = line.adjust_position(start, -1);
+  }
+  if (start == line.size() || !line.is_alnum(start)) {
+    return std::string();
+  }
+  while (start > 0 && line.is_alnum(line.adjust_position(start, -1))) {
+    start = line.adjust_position(start, -1);
+  }
+  text_pos_t end = start;
+  while (end < line.size() && line.is_alnum(end)) {
+    end = line.adjust_position(end, 1);
+  }
+  return line.get_data().substr(start, end - start);
+}
+
 void file_buffer_t::set_top_left_in_behavior_parameters(text_coordinate_t pos) {
   behavior_parameters->set_top_left(pos);
 }
@@ -15,45 +15,182 @@
 #define FILE_BUFFER_H
 
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <t3highlight/highlight.h>
 #include <t3widget/widget.h>
 
 using namespace t3widget;
 
+#include "tilde/braceindex.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightprogress.h"
+#include "tilde/wordindex.h"
 
+class file_buffer_t;
 class file_edit_window_t;
 
+/** The highlighting matcher used by one consumer of the highlighting of a file_buffer_t.
+
+    Each view of a buffer, brace matching, and the propagation of start states use their own
+    cursor, such that interleaved accesses do not reset each other's matcher.
+*/
+class highlight_cursor_t {
+ public:
+  highlight_cursor_t() = default;
+  highlight_cursor_t(const highlight_cursor_t &) = delete;
+  highlight_cursor_t &operator=(const highlight_cursor_t &) = delete;
+  ~highlight_cursor_t();
+
+  /** Get the matcher, reset to start matching a line with start state @p state.
+
+      The matcher is recreated if @p file has different highlighting patterns than those it was
+      created for. @p file must have highlighting patterns.
+  */
+  t3_highlight_match_t *start_line(const file_buffer_t *file, int state);
+
+  /** Look up the end state of a short line, as previously stored with store_end_state.
+
+      Many lines, such as empty lines and lines with only a closing brace, occur many times in a
+      file. Remembering their end states per start state avoids matching them again.
+  */
+  bool find_end_state(const file_buffer_t *file, int state, const std::string &line,
+                      int *end_state) const;
+  /** Remember the end state of @p line when it starts in @p state. Must be called after
+      start_line for the same file. Lines that are not short are ignored. */
+  void store_end_state(int state, const std::string &line, int end_state);
+
+ private:
+  static std::string end_state_key(int state, const std::string &line);
+
+  t3_highlight_match_t *match = nullptr;
+  int match_generation = -1;
+  std::unordered_map<std::string, int> end_states;
+};
+
+/** The highlighting of a single line, computed for a particular start state. */
+struct line_highlight_t {
+  /* A run of characters with the same highlighting attribute. The span ends where the next span
+     starts, or at the end of the line. */
+  struct span_t {
+    size_t start;
+    int idx;
+  };
+
+  std::vector<span_t> spans;
+  int start_state = 0, end_state = 0;
+  int generation = -1;
+  size_t size = 0;
+  /* The part of the line covered by spans. This is the whole line, except for lines longer than
+     option.max_highlight_line_length. */
+  size_t window_start = 0, window_end = 0;
+};
+
 class file_buffer_t : public text_buffer_t {
   friend class file_edit_window_t;  // Required to access behavior_parameters and set_has_window
   friend class file_line_t;
+  friend class highlight_cursor_t;
 
  private:
   std::string name, encoding;
   text_line_t name_line;
   std::unique_ptr<edit_window_t::behavior_parameters_t> behavior_parameters;
-  bool has_window;
-  text_pos_t highlight_valid;
+  int window_count;
+  // Which of the start states in highlight_states are up to date.
+  highlight_progress_t highlight_progress;
+  /* The highlighting state at the start of each line. Kept outside the lines, such that computing
+     them is a linear pass over this array and the line contents. */
+  std::vector<int> highlight_states;
+  /* The highlighting of recently painted or searched lines. An entry is only used if it was
+     computed for the current highlight_generation, start state and line size. */
+  std::unordered_map<const text_line_t *, line_highlight_t> line_highlights;
+  // The line for which prepare_paint_line was last called, i.e. the line being painted.
+  text_pos_t paint_line;
+  /* What painting a character of paint_line needs, resolved once per line by prepare_paint_line.
+     Only valid for the line object in paint_line_data. */
+  const text_line_t *paint_line_data = nullptr;
+  int paint_state = -1;
+  text_pos_t paint_brace_pos = -1;
+  /* The attributes used for painting, indexed by 2 * (highlight index + 1), with the brace
+     highlight combined in at the odd indices. Index 0 is for text without highlighting. Rebuilt
+     when the attributes change. */
+  std::vector<t3_attr_t> paint_palette;
+  int paint_palette_version = -1;
+  t3_attr_t paint_palette_normal = 0, paint_palette_brace = 0;
+  /* Lines after highlight_progress.valid with a start state loaded from the checkpoint cache, in
+     ascending order. The start states from checkpoint_first up to and including checkpoint_last
+     have been computed from one of these checkpoints. */
+  std::vector<text_pos_t> highlight_checkpoints;
+  text_pos_t checkpoint_first, checkpoint_last;
   optional<bool> strip_spaces;
   t3_highlight_t *highlight_info;
-  const text_line_t *match_line;
-  t3_highlight_match_t *last_match;
+  /* Changed whenever highlight_info changes, to invalidate line_highlights and the matchers of
+     highlight cursors. */
+  int highlight_generation = 0;
+  // The cursor used for painting. Points to default_cursor when no view has set its own.
+  highlight_cursor_t *paint_cursor;
+  highlight_cursor_t default_cursor, brace_cursor, state_cursor;
+  // Brace counts of the lines, used by find_matching_brace.
+  brace_index_t brace_index;
   bool matching_brace_valid;
   text_coordinate_t matching_brace_coordinate;
+  // Changed on every edit, to detect that derived information is outdated.
+  int edit_count = 0;
+  /* The cursor, edit_count and highlight_generation for which matching_brace_valid was last
+     computed, and whether that search ran out of its budget before it was done. */
+  text_coordinate_t brace_search_cursor{-1, -1};
+  int brace_search_edit_count = -1;
+  int brace_search_highlight_generation = -1;
+  bool brace_search_pending = false;
   std::string line_comment;
+  word_index_t word_index;
+  // The name of the language of highlight_info, if known.
+  std::string language;
+  /* Whether the language was found by the language detection in load, rather than chosen by
+     hand. Only a detected language may be reused when the file is opened again. */
+  bool language_detected = false;
 
  private:
   void prepare_paint_line(text_pos_t line) override;
+  void prepare_highlight_states(text_pos_t line);
+  void update_paint_palette(t3_attr_t normal_attr);
+  void propagate_highlight_parallel(text_pos_t first, text_pos_t last);
+  bool prepare_paint_line_from_checkpoint(text_pos_t line);
+  void load_checkpoints();
+  bool load_recent_language();
+  void check_highlight_states();
+  bool set_highlight_start(text_pos_t line, int state);
+  int get_highlight_end(text_pos_t line);
+  int get_highlight_idx(text_pos_t line, text_pos_t pos, highlight_cursor_t *cursor);
   void set_has_window(bool _has_window);
   void invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos);
-  bool find_matching_brace(text_coordinate_t &match_location);
+  void invalidate_word_index(rewrap_type_t type, text_pos_t line, text_pos_t pos);
+  /** Compute the brace counts of the lines [@p first, @p last) that are not known yet.
+
+      @param budget If not @c nullptr, the maximum number of lines to compute, decreased by the
+          number of lines computed.
+      @return @c false if the budget ran out before all lines were computed.
+  */
+  bool update_brace_summaries(text_pos_t first, text_pos_t last, text_pos_t *budget);
+  text_pos_t find_brace_line_forward(int kind, text_pos_t first, int *depth, text_pos_t *budget);
+  text_pos_t find_brace_line_backward(int kind, text_pos_t last, int *need, text_pos_t *budget);
+  /** Find the brace matching the one under the cursor.
+
+      @param budget See update_brace_summaries. If the budget runs out, @c false is returned and
+          @p budget is set to 0.
+  */
+  bool find_matching_brace(text_coordinate_t &match_location, text_pos_t *budget);
 
  public:
   explicit file_buffer_t(string_view _name = {"", 0}, string_view _encoding = {"", 0});
   ~file_buffer_t() override;
   rw_result_t load(load_process_t *state);
   rw_result_t save(save_as_process_t *state);
+  /** Store the highlighting checkpoints of the buffer in the cache directory. This is done when
+      the buffer is destroyed, and must be called for the buffers still open at exit. */
+  void save_checkpoints();
 
   const std::string &get_name() const;
   const char *get_encoding() const;
@@ -61,9 +198,32 @@ class file_buffer_t : public text_buffer_t {
   text_line_t *get_name_line();
 
   bool get_has_window() const;
+  /** Set the highlight cursor used for painting, or @c nullptr to use the buffer's own cursor. */
+  void set_paint_cursor(highlight_cursor_t *cursor);
 
   t3_highlight_t *get_highlight();
-  void set_highlight(t3_highlight_t *highlight);
+  /** Set the highlighting patterns, which are released when no longer used.
+
+      @param language_name The name of the language of @p highlight, or @c nullptr if not known.
+  */
+  void set_highlight(t3_highlight_t *highlight, const char *language_name);
+  const std::string &get_language() const;
+  /** Returns whether the language was found by the language detection when loading the file,
+      rather than set by hand afterwards. */
+  bool get_language_detected() const;
+  /** Get a hash of the inputs of the language detection: the name, the first and last lines, the
+      files in the libt3highlight search path and option.line_comment_map.
+
+      If the hash is unchanged when the file is opened again, the language found previously is used
+      instead of running the detection again.
+  */
+  std::string get_detection_key() const;
+  /** Compute the highlighting start states for at most @p max_lines more lines.
+
+      @return A boolean indicating whether there are lines left for which the start state is not
+          known.
+  */
+  bool advance_highlight(text_pos_t max_lines);
 
   bool get_strip_spaces() const;
   void set_strip_spaces(bool _strip_spaces);
@@ -73,14 +233,39 @@ class file_buffer_t : public text_buffer_t {
   bool goto_matching_brace();
   /** Update the matching brace information in the file_buffer_t.
 
+      Nothing is done if neither the cursor nor the text changed since the last update. A search
+      that needs to compute the brace counts of many lines is spread over several updates, and
+      requests another update through signal_update until it is done.
+
       @return A boolean indicating whether the matching brace information changed.
   */
   bool update_matching_brace();
 
   void set_line_comment(const char *text);
+  const std::string &get_line_comment() const;
   void toggle_line_comment();
 
   const char *get_char_under_cursor(size_t *size) const;
+  /** Returns the word the cursor is in or directly after, or an empty string if there is none.
+      Words are split in the same way as for autocompletion. */
+  std::string get_word_under_cursor() const;
+
+  /** Append the words in the buffer that start with @p prefix to @p words, in sorted order.
+
+      The words remain valid until the buffer is modified. This is only done if the word index
+      has been built, as building it scans the whole buffer. Otherwise @c false is returned. The
+      index is built in the background once the file has been loaded.
+  */
+  bool find_indexed_words(string_view prefix, std::vector<string_view> *words);
+  /** Copy up to @p count more lines for building the word index. Returns @c true once all lines
+      have been copied, or if the word index has been built already. */
+  bool copy_word_index_lines(text_pos_t count);
+  /** Returns the lines copied by copy_word_index_lines, and records the changes to the buffer
+      from now on, for install_word_index. */
+  std::vector<std::string> take_word_index_copy();
+  /** Use @p index, built from the lines returned by take_word_index_copy, as the word index.
+      Ignored if the word index has been built since. */
+  void install_word_index(word_index_t &&index);
 
   void set_top_left_in_behavior_parameters(text_coordinate_t pos);
 };
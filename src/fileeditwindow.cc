@@ -12,6 +12,9 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "tilde/fileeditwindow.h"
+
+#include <algorithm>
+
 #include "tilde/fileautocompleter.h"
 #include "tilde/log.h"
 #include "tilde/main.h"
@@ -122,28 +125,57 @@ void file_edit_window_t::goto_matching_brace() {
   }
 }
 
+void file_edit_window_t::jump_to_line(text_pos_t line) {
+  get_text()->goto_pos(line, 1);
+  ensure_cursor_on_screen();
+  force_redraw();
+}
+
 void file_edit_window_t::update_contents() {
   /* Ideally we would only update this when the screen will get updated.
      However, the problem is that we don't know exactly when this will be.
      Simply checking redraw doesn't work, because the contents is redrawn
      every time this is called if the edit window has focus (which we can't
-     query at this time). Thus we simply update every time :-(
-
-     Another improvement would be if we could find out the positions of the
-     old and new matching brace positions. That would allow more localized
-     updates.
+     query at this time). Thus we call this every time, and the buffer only
+     searches again if the cursor or the text changed.
   */
-  if (get_text()->update_matching_brace()) {
-    update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
+  file_buffer_t *_text = get_text();
+  bool old_valid = _text->matching_brace_valid;
+  text_coordinate_t old_brace = _text->matching_brace_coordinate;
+  text_coordinate_t old_cursor = _text->brace_search_cursor;
+  if (_text->update_matching_brace()) {
+    /* Both the brace under the cursor and the matching brace are highlighted, so only the lines
+       of the old and the new pair need repainting. */
+    if (old_valid) {
+      update_repaint_lines(old_brace.line, old_brace.line);
+      update_repaint_lines(old_cursor.line, old_cursor.line);
+    }
+    if (_text->matching_brace_valid) {
+      update_repaint_lines(_text->matching_brace_coordinate.line,
+                           _text->matching_brace_coordinate.line);
+      update_repaint_lines(_text->get_cursor().line, _text->get_cursor().line);
+    }
   }
+  get_text()->set_paint_cursor(&highlight_cursor);
   edit_window_t::update_contents();
+  get_text()->set_paint_cursor(nullptr);
 }
 
 void file_edit_window_t::force_repaint_to_bottom(rewrap_type_t type, text_pos_t line,
                                                  text_pos_t pos) {
   (void)type;
   (void)pos;
-  update_repaint_lines(line, std::numeric_limits<text_pos_t>::max());
+  /* The highlighting of all lines after the edit may change, but only the visible lines need to
+     be repainted. Lines are at least one screen line high, so no more lines than the height of
+     the window are visible. If the window scrolls, the edit_window_t repaints all of it anyway. */
+  edit_window_t::behavior_parameters_t parameters;
+  save_behavior_parameters(&parameters);
+  text_pos_t top = parameters.get_top_left().line;
+  text_pos_t bottom = top + window.get_height();
+  if (line > bottom) {
+    return;
+  }
+  update_repaint_lines(std::max(line, top), bottom);
 }
 
 void file_edit_window_t::show_character_details() {
@@ -22,6 +22,8 @@ using namespace t3widget;
 class file_edit_window_t : public edit_window_t {
  private:
   connection_t rewrap_connection;
+  // Keeps the highlighting matcher of this window separate from other views of the same buffer.
+  highlight_cursor_t highlight_cursor;
   void force_repaint_to_bottom(rewrap_type_t type, text_pos_t line, text_pos_t pos);
 
  public:
@@ -34,6 +36,8 @@ class file_edit_window_t : public edit_window_t {
   void set_text(file_buffer_t *_text);
   file_buffer_t *get_text() const;
   void goto_matching_brace();
+  /** Move the cursor to the start of the 1-based @p line and show it. */
+  void jump_to_line(text_pos_t line);
   void show_character_details();
   void save_behavior_parameters_in_buffer();
 };
@@ -11,78 +11,178 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+
 #include "tilde/fileline.h"
 #include "tilde/option.h"
 
 static file_line_factory_t default_file_line_factory(nullptr);
 
+/* The maximum number of lines for which the highlighting is cached. When the cache is full, it is
+   emptied, so it only holds the lines that were painted or searched most recently. */
+static const size_t max_cached_line_highlights = 8192;
+
 file_line_t::file_line_t(int buffersize, file_line_factory_t *_factory)
-    : text_line_t(buffersize, _factory == nullptr ? &default_file_line_factory : _factory),
-      highlight_start_state(0) {}
+    : text_line_t(buffersize, _factory == nullptr ? &default_file_line_factory : _factory) {}
 
 file_line_t::file_line_t(string_view _buffer, file_line_factory_t *_factory)
-    : text_line_t(_buffer, _factory == nullptr ? &default_file_line_factory : _factory),
-      highlight_start_state(0) {}
+    : text_line_t(_buffer, _factory == nullptr ? &default_file_line_factory : _factory) {}
+
+bool file_line_t::is_long_line() const {
+  return option.max_highlight_line_length > 0 &&
+         get_data().size() > option.max_highlight_line_length;
+}
 
-int file_line_t::get_highlight_idx(text_pos_t i) const {
+/* Lines longer than option.max_highlight_line_length are only highlighted in a window of
+   2 * long_line_margin bytes around the position that is asked for. Matching starts at the start
+   of the window as if it were the start of the line, so the highlighting is approximate. */
+static const size_t long_line_margin = 4096;
+
+static bool line_highlight_valid(const line_highlight_t &highlight, int generation, int state,
+                                 size_t size) {
+  return highlight.generation == generation && highlight.start_state == state &&
+         highlight.size == size;
+}
+
+const line_highlight_t &file_line_t::get_line_highlight(file_buffer_t *file, int state,
+                                                        highlight_cursor_t *cursor,
+                                                        size_t pos) const {
+  const std::string &str = get_data();
+  auto iter = file->line_highlights.find(this);
+  if (iter != file->line_highlights.end() &&
+      line_highlight_valid(iter->second, file->highlight_generation, state, str.size()) &&
+      pos >= iter->second.window_start && pos < iter->second.window_end) {
+    return iter->second;
+  }
+  if (iter == file->line_highlights.end()) {
+    if (file->line_highlights.size() >= max_cached_line_highlights) {
+      file->line_highlights.clear();
+    }
+    iter = file->line_highlights.insert(std::make_pair(this, line_highlight_t())).first;
+  }
+  line_highlight_t &highlight = iter->second;
+
+  size_t window_start = 0, window_end = str.size();
+  bool long_line = is_long_line();
+  if (long_line) {
+    window_start = pos > long_line_margin ? pos - long_line_margin : 0;
+    window_end = std::min(window_end, pos + long_line_margin);
+    // Don't split UTF-8 sequences at the window boundaries.
+    while (window_start > 0 && (str[window_start] & 0xC0) == 0x80) {
+      --window_start;
+    }
+    while (window_end < str.size() && (str[window_end] & 0xC0) == 0x80) {
+      ++window_end;
+    }
+  }
+
+  highlight.spans.clear();
+  t3_highlight_match_t *match = cursor->start_line(file, state);
+  bool more_matches;
+  do {
+    more_matches =
+        t3_highlight_match(match, str.data() + window_start, window_end - window_start);
+    size_t start = t3_highlight_get_start(match) + window_start;
+    size_t match_start = t3_highlight_get_match_start(match) + window_start;
+    int begin_idx = t3_highlight_get_begin_attr(match);
+    int match_idx = t3_highlight_get_match_attr(match);
+
+    if (start < match_start &&
+        (highlight.spans.empty() || highlight.spans.back().idx != begin_idx)) {
+      highlight.spans.push_back(line_highlight_t::span_t{start, begin_idx});
+    }
+    if (match_start < t3_highlight_get_end(match) + window_start &&
+        (highlight.spans.empty() || highlight.spans.back().idx != match_idx)) {
+      highlight.spans.push_back(line_highlight_t::span_t{match_start, match_idx});
+    }
+  } while (more_matches);
+  highlight.spans.shrink_to_fit();
+
+  // See compute_highlight_end for the end state of long lines.
+  highlight.end_state = long_line ? state : t3_highlight_get_state(match);
+  highlight.start_state = state;
+  highlight.generation = file->highlight_generation;
+  highlight.size = str.size();
+  highlight.window_start = window_start;
+  highlight.window_end = window_end;
+  return highlight;
+}
+
+int file_line_t::get_highlight_idx(text_pos_t i, int state, highlight_cursor_t *cursor) const {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
 
   if (file == nullptr || file->highlight_info == nullptr) {
     return -1;
   }
 
-  const std::string &str = get_data();
-  if (static_cast<size_t>(i) >= str.size()) {
+  if (static_cast<size_t>(i) >= get_data().size()) {
     return -1;
   }
 
-  if (file->match_line != this ||
-      static_cast<size_t>(i) < t3_highlight_get_start(file->last_match)) {
-    file->match_line = this;
-    t3_highlight_reset(file->last_match, highlight_start_state);
-  }
-
-  while (t3_highlight_get_end(file->last_match) <= static_cast<size_t>(i)) {
-    t3_highlight_match(file->last_match, str.data(), str.size());
+  const std::vector<line_highlight_t::span_t> &spans =
+      get_line_highlight(file, state, cursor, i).spans;
+  // Find the last span that starts at or before i.
+  auto iter = std::upper_bound(
+      spans.begin(), spans.end(), static_cast<size_t>(i),
+      [](size_t pos, const line_highlight_t::span_t &span) { return pos < span.start; });
+  if (iter == spans.begin()) {
+    return -1;
   }
-
-  return static_cast<size_t>(i) < t3_highlight_get_match_start(file->last_match)
-             ? t3_highlight_get_begin_attr(file->last_match)
-             : t3_highlight_get_match_attr(file->last_match);
+  return (iter - 1)->idx;
 }
 
 t3_attr_t file_line_t::get_base_attr(text_pos_t i, const paint_info_t &info) const {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
-  int idx = get_highlight_idx(i);
-  t3_attr_t result = option.highlights.lookup_attributes(idx).value_or(info.normal_attr);
-
+  if (info.normal_attr != file->paint_palette_normal || file->paint_palette.empty()) {
+    file->update_paint_palette(info.normal_attr);
+  }
+  bool is_paint_line = file->paint_line_data == this;
+  int idx = is_paint_line && file->paint_state >= 0
+                ? get_highlight_idx(i, file->paint_state, file->paint_cursor)
+                : -1;
+  size_t entry = 2 * static_cast<size_t>(idx + 1);
+  if (entry >= file->paint_palette.size()) {
+    entry = 0;
+  }
   if (file->matching_brace_valid &&
-      (i == info.cursor || (this == &file->get_line_data(file->matching_brace_coordinate.line) &&
-                            i == file->matching_brace_coordinate.pos))) {
-    result = t3_term_combine_attrs(result, option.brace_highlight);
+      (i == info.cursor || (is_paint_line && i == file->paint_brace_pos))) {
+    ++entry;
   }
-
-  return result;
+  return file->paint_palette[entry];
 }
 
-void file_line_t::set_highlight_start(int state) { highlight_start_state = state; }
-
-int file_line_t::get_highlight_end() {
+int file_line_t::compute_highlight_end(int state, highlight_cursor_t *cursor) const {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
   if (file == nullptr || file->highlight_info == nullptr) {
     return 0;
   }
 
-  if (file->match_line != this) {
-    file->match_line = this;
-    t3_highlight_reset(file->last_match, highlight_start_state);
+  const std::string &str = get_data();
+  auto iter = file->line_highlights.find(this);
+  if (iter != file->line_highlights.end() &&
+      line_highlight_valid(iter->second, file->highlight_generation, state, str.size())) {
+    return iter->second.end_state;
   }
 
-  const std::string &str = get_data();
-  while (t3_highlight_match(file->last_match, str.data(), str.size())) {
+  /* Matching a very long line to the end would stall the editor whenever it is edited, or when
+     anything below it is painted. Instead, such lines are assumed to end in the state they start
+     in. This resets the highlighting after the line, if the line does change the state. */
+  if (is_long_line()) {
+    return state;
+  }
+
+  int end_state;
+  if (cursor->find_end_state(file, state, str, &end_state)) {
+    return end_state;
+  }
+
+  t3_highlight_match_t *match = cursor->start_line(file, state);
+  while (t3_highlight_match(match, str.data(), str.size())) {
   }
 
-  return t3_highlight_get_state(file->last_match);
+  end_state = t3_highlight_get_state(match);
+  cursor->store_end_state(state, str, end_state);
+  return end_state;
 }
 
 //====================== file_line_factory_t ========================
@@ -22,15 +22,24 @@ class file_line_factory_t;
 
 class file_line_t : public text_line_t {
  protected:
-  int highlight_start_state;
+  bool is_long_line() const;
+  const line_highlight_t &get_line_highlight(file_buffer_t *file, int state,
+                                             highlight_cursor_t *cursor, size_t pos) const;
 
  public:
   file_line_t(int buffersize = BUFFERSIZE, file_line_factory_t *_factory = nullptr);
   file_line_t(string_view _buffer, file_line_factory_t *_factory = nullptr);
 
-  void set_highlight_start(int state);
-  int get_highlight_end();
-  int get_highlight_idx(text_pos_t i) const;
+  /** Compute the highlighting state at the end of the line, if the line starts in @p state.
+
+      This does not modify the line or the buffer, and may be called from several threads at once
+      for different lines, as long as each thread uses its own @p cursor and the buffer is not
+      modified.
+  */
+  int compute_highlight_end(int state, highlight_cursor_t *cursor) const;
+  /** Get the highlighting attribute index of the character at @p i, if the line starts in
+      @p state. */
+  int get_highlight_idx(text_pos_t i, int state, highlight_cursor_t *cursor) const;
 
  protected:
   t3_attr_t get_base_attr(text_pos_t i, const paint_info_t &info) const override;
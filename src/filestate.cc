@@ -13,12 +13,15 @@
 */
 #include <cstring>
 
+#include "tilde/batchsave.h"
 #include "tilde/filebuffer.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightcache.h"
 #include "tilde/log.h"
 #include "tilde/main.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
+#include "tilde/worker_pool.h"
 
 load_process_t::load_process_t(const callback_t &cb)
     : stepped_process_t(cb),
@@ -248,7 +251,9 @@ bool save_as_process_t::step() {
       } else if (backup_saved) {
         message.append("\n\nThe original contents of the file can still be retrieved from ");
         // FIXME: the file names probably needs to be converted from some other character set.
-        if (!temp_name.empty()) {
+        if (!version_name.empty()) {
+          message.append(version_name);
+        } else if (!temp_name.empty()) {
           message.append(temp_name);
         } else {
           message.append(name);
@@ -326,8 +331,14 @@ void save_as_process_t::file_selected(const std::string &_name) {
   state = INITIAL;
   if (allow_highlight_change) {
     highlight_changed = true;
-    file->set_highlight(t3_highlight_load_by_filename(name.c_str(), map_highlight, nullptr,
-                                                      T3_HIGHLIGHT_UTF8, nullptr));
+    t3_highlight_lang_t lang;
+    if (t3_highlight_lang_by_filename(name.c_str(), T3_HIGHLIGHT_UTF8, &lang, nullptr)) {
+      file->set_highlight(load_shared_highlight(lang.lang_file, kHighlightLoadFlags, nullptr),
+                          lang.name);
+      t3_highlight_free_lang(lang);
+    } else {
+      file->set_highlight(nullptr, nullptr);
+    }
   }
   run();
 }
@@ -436,6 +447,214 @@ void close_process_t::execute(const callback_t &cb, file_buffer_t *_file) {
 
 const file_buffer_t *close_process_t::get_file_buffer_ptr() { return file; }
 
+save_all_process_t::save_all_process_t(const callback_t &cb,
+                                       const std::vector<file_buffer_t *> &files)
+    : stepped_process_t(cb) {
+  for (file_buffer_t *file : files) {
+    if (file->get_name().empty()) {
+      interactive_files.push_back(file);
+    } else {
+      batch.push_back(make_unique<batch_save_t>(file));
+    }
+  }
+}
+
+save_all_process_t::~save_all_process_t() {
+  for (connection_t &connection : dialog_connections) {
+    connection.disconnect();
+  }
+}
+
+bool save_all_process_t::step() {
+  std::string message;
+
+  if (state == ENCODE) {
+    /* Preparing modifies the buffers and opens the converters, which must be done on the main
+       thread. Any failure here is left to save_process_t to report. */
+    for (auto iter = batch.begin(); iter != batch.end();) {
+      if ((*iter)->prepare() != rw_result_t::SUCCESS) {
+        interactive_files.push_back((*iter)->get_file());
+        iter = batch.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+
+    std::vector<rw_result_t> encode_results(batch.size());
+    // Encoding only reads the lines of the buffers, which run_parallel allows.
+    worker_pool.run_parallel(batch.size(), [this, &encode_results](size_t i) {
+      encode_results[i] = batch[i]->encode();
+    });
+    for (size_t i = batch.size(); i > 0; --i) {
+      if (encode_results[i - 1] != rw_result_t::SUCCESS) {
+        interactive_files.push_back(batch[i - 1]->get_file());
+        batch.erase(batch.begin() + (i - 1));
+      }
+    }
+    state = CONFIRM_IMPRECISE;
+    idx = 0;
+  }
+
+  if (state == CONFIRM_IMPRECISE) {
+    for (; idx < batch.size(); ++idx) {
+      if (!batch[idx]->is_imprecise()) {
+        continue;
+      }
+      file_buffer_t *file = batch[idx]->get_file();
+      printf_into(&message,
+                  "Conversion of '%s' into encoding %s is irreversible\n\nThe loaded buffer will "
+                  "continue to hold the original text, but the on-disk version will differ.",
+                  file->get_name().c_str(), file->get_encoding());
+      dialog_connections.push_back(
+          continue_abort_dialog->connect_activate([this] { dialog_answered(true); }, 0));
+      dialog_connections.push_back(
+          continue_abort_dialog->connect_activate([this] { dialog_answered(false); }, 1));
+      dialog_connections.push_back(
+          continue_abort_dialog->connect_closed([this] { dialog_answered(false); }));
+      continue_abort_dialog->set_message(message);
+      continue_abort_dialog->show();
+      return false;
+    }
+    state = WRITE;
+  }
+
+  if (state == WRITE) {
+    write_files();
+    state = REPORT_ERRORS;
+  }
+
+  if (state == REPORT_ERRORS) {
+    if (!error_messages.empty()) {
+      dialog_connections.push_back(
+          error_dialog->connect_activate([this] { dialog_answered(true); }, 0));
+      dialog_connections.push_back(error_dialog->connect_closed([this] { dialog_answered(true); }));
+      error_dialog->set_message(error_messages.front());
+      error_messages.pop_front();
+      error_dialog->show();
+      return false;
+    }
+    state = INTERACTIVE_SAVE;
+    idx = 0;
+  }
+
+  if (state == INTERACTIVE_SAVE) {
+    while (idx < interactive_files.size()) {
+      in_interactive_save = true;
+      save_process_t::execute(bind_front(&save_all_process_t::interactive_save_done, this),
+                              interactive_files[idx]);
+      if (in_interactive_save) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void save_all_process_t::write_files() {
+  std::vector<int> fds;
+  std::vector<int> sync_errors;
+  std::vector<rw_result_t> write_results(batch.size());
+
+  lprintf("Saving %zd files in parallel\n", batch.size());
+  worker_pool.run_parallel(batch.size(), [this](size_t i) { batch[i]->open_and_backup(); });
+
+  /* The backups must be on disk before any of the original files is overwritten. Otherwise a
+     crash could leave both the file and its backup incomplete. */
+  for (const std::unique_ptr<batch_save_t> &item : batch) {
+    fds.push_back(item->get_backup_fd());
+  }
+  sync_files(fds, &sync_errors);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    batch[i]->backup_synced(sync_errors[i]);
+  }
+
+  worker_pool.run_parallel(batch.size(), [this, &write_results](size_t i) {
+    write_results[i] = batch[i]->write();
+  });
+
+  fds.clear();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    fds.push_back(write_results[i] == rw_result_t::SUCCESS ? batch[i]->get_fd() : -1);
+  }
+  sync_files(fds, &sync_errors);
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    batch_save_t *item = batch[i].get();
+    rw_result_t rw_result = write_results[i];
+    if (rw_result == rw_result_t::SUCCESS) {
+      rw_result = item->finish(sync_errors[i]);
+    }
+    if (item->needs_interactive_save()) {
+      interactive_files.push_back(item->get_file());
+      continue;
+    }
+    if (rw_result == rw_result_t::SUCCESS) {
+      continue;
+    }
+
+    std::string message;
+    printf_into(&message, "Could not save file '%s': %s.", item->get_file()->get_name().c_str(),
+                strerror(rw_result.get_errno_error()));
+    if (rw_result == rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED) {
+      message.append("\n\nThe original file has not been touched.");
+    } else if (item->is_backup_saved()) {
+      message.append("\n\nThe original contents of the file can still be retrieved from ");
+      message.append(item->get_backup_name());
+      message.append(".");
+    } else {
+      message.append("\n\nThe original file contents are lost.");
+    }
+    message.append(
+        " Save the current buffer to another location to ensure its contents are preserved!");
+    error_messages.push_back(message);
+    result = false;
+  }
+  batch.clear();
+}
+
+void save_all_process_t::dialog_answered(bool do_continue) {
+  for (connection_t &connection : dialog_connections) {
+    connection.disconnect();
+  }
+  dialog_connections.clear();
+
+  if (!do_continue) {
+    abort();
+    return;
+  }
+  if (state == CONFIRM_IMPRECISE) {
+    ++idx;
+  }
+  run();
+}
+
+void save_all_process_t::interactive_save_done(stepped_process_t *process) {
+  in_interactive_save = false;
+  if (process->get_result()) {
+    ++idx;
+  } else {
+    result = false;
+    idx = interactive_files.size();
+  }
+  if (!in_step) {
+    run();
+  }
+}
+
+void save_all_process_t::execute(const callback_t &cb) {
+  std::vector<file_buffer_t *> files;
+  for (file_buffer_t *file : open_files) {
+    if (file->is_modified()) {
+      files.push_back(file);
+    }
+  }
+  execute(cb, files);
+}
+
+void save_all_process_t::execute(const callback_t &cb, const std::vector<file_buffer_t *> &files) {
+  (new save_all_process_t(cb, files))->run();
+}
+
 exit_process_t::exit_process_t(const callback_t &cb)
     : stepped_process_t(cb), iter(open_files.begin()) {
   connections.push_back(close_confirm_dialog->connect_activate([this] { do_save(); }, 0));
@@ -455,6 +674,19 @@ bool exit_process_t::step() {
       return false;
     }
   }
+  /* The files with a name are only saved once all questions have been answered, such that they
+     can be written concurrently. */
+  if (!files_to_save.empty() && !files_saved) {
+    files_saved = true;
+    in_save_all = true;
+    save_all_process_t::execute(bind_front(&exit_process_t::save_all_done, this), files_to_save);
+    if (in_save_all) {
+      return false;
+    }
+    if (!result) {
+      return true;
+    }
+  }
   for (file_buffer_t *buffer : open_files) {
     recent_files.push_front(buffer);
   }
@@ -462,6 +694,12 @@ bool exit_process_t::step() {
 }
 
 void exit_process_t::do_save() {
+  if (!(*iter)->get_name().empty()) {
+    files_to_save.push_back(*iter);
+    ++iter;
+    run();
+    return;
+  }
   save_process_t::execute(bind_front(&exit_process_t::save_done, this), *iter);
 }
 
@@ -479,6 +717,15 @@ void exit_process_t::save_done(stepped_process_t *process) {
   }
 }
 
+void exit_process_t::save_all_done(stepped_process_t *process) {
+  in_save_all = false;
+  if (!process->get_result()) {
+    abort();
+  } else if (!in_step) {
+    run();
+  }
+}
+
 void exit_process_t::execute(const callback_t &cb) {
   (new exit_process_t([cb](stepped_process_t *process) {
     lprintf("Exit process callback with result %d\n", process->get_result());
@@ -14,9 +14,11 @@
 #ifndef FILESTATE_H
 #define FILESTATE_H
 #include <cerrno>
+#include <memory>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <vector>
 
 #include <t3widget/signals.h>
 #include <t3widget/widget.h>
@@ -28,6 +30,7 @@
 
 using namespace t3widget;
 
+class batch_save_t;
 class file_buffer_t;
 
 class rw_result_t {
@@ -123,6 +126,7 @@ class save_as_process_t : public stepped_process_t {
   const char *save_name = nullptr;
   std::string real_name;
   std::string temp_name;
+  std::string version_name;
   int fd = -1;
   int backup_fd = -1;
   int readonly_fd = -1;
@@ -130,6 +134,8 @@ class save_as_process_t : public stepped_process_t {
   ino_t readonly_ino;
   bool backup_saved = false;
   off_t computed_length = 0;
+  // The converted text, if it was converted in parallel.
+  std::vector<std::string> encoded_blocks;
   optional<mode_t> original_mode;
   text_pos_t i;
   transcript_t *conversion_handle = nullptr;
@@ -170,15 +176,50 @@ class close_process_t : public save_process_t {
   virtual const file_buffer_t *get_file_buffer_ptr();
 };
 
+/** Saves a set of files, writing them concurrently on the worker threads.
+
+    All questions to the user are asked one at a time, before any file is touched. Files that
+    require more interaction, such as untitled or read-only files, are saved one by one through
+    save_process_t after the other files have been written.
+*/
+class save_all_process_t : public stepped_process_t {
+ protected:
+  enum { ENCODE, CONFIRM_IMPRECISE, WRITE, REPORT_ERRORS, INTERACTIVE_SAVE };
+  int state = ENCODE;
+
+  std::vector<std::unique_ptr<batch_save_t>> batch;
+  std::vector<file_buffer_t *> interactive_files;
+  std::list<std::string> error_messages;
+  std::list<connection_t> dialog_connections;
+  size_t idx = 0;
+  bool in_interactive_save = false;
+
+  save_all_process_t(const callback_t &cb, const std::vector<file_buffer_t *> &files);
+  ~save_all_process_t() override;
+  bool step() override;
+  void write_files();
+  void dialog_answered(bool do_continue);
+  virtual void interactive_save_done(stepped_process_t *process);
+
+ public:
+  /** Save all modified buffers. */
+  static void execute(const callback_t &cb);
+  static void execute(const callback_t &cb, const std::vector<file_buffer_t *> &files);
+};
+
 class exit_process_t : public stepped_process_t {
  protected:
   open_files_t::iterator iter;
+  std::vector<file_buffer_t *> files_to_save;
+  bool files_saved = false;
+  bool in_save_all = false;
 
   explicit exit_process_t(const callback_t &cb);
   bool step() override;
   virtual void do_save();
   virtual void dont_save();
   virtual void save_done(stepped_process_t *process);
+  virtual void save_all_done(stepped_process_t *process);
 
  public:
   static void execute(const callback_t &cb);
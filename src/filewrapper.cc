@@ -124,6 +124,15 @@ int file_read_wrapper_t::get_fill() { return buffer->get_fill(); }
 
 bool file_read_wrapper_t::fill_buffer(int used) { return buffer->fill_buffer(used); }
 
+void file_write_wrapper_t::write_output(const char *buffer, size_t bytes) {
+  if (output_ != nullptr) {
+    output_->append(buffer, bytes);
+  } else if (fd_ >= 0 && nosig_write(fd_, buffer, bytes) < 0) {
+    throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  written_size_ += bytes;
+}
+
 void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
   std::unique_ptr<char, free_deleter> nfc_output;
   size_t nfc_output_len;
@@ -137,10 +146,7 @@ void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
   nfc_output.reset(reinterpret_cast<char *>(u8_normalize(
       UNINORM_NFC, reinterpret_cast<const uint8_t *>(buffer), bytes, nullptr, &nfc_output_len)));
   if (handle_ == nullptr) {
-    if (fd_ >= 0 && nosig_write(fd_, nfc_output.get(), nfc_output_len) < 0) {
-      throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
-    }
-    written_size_ += nfc_output_len;
+    write_output(nfc_output.get(), nfc_output_len);
     return;
   }
 
@@ -169,11 +175,7 @@ void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
     }
     if (transcript_buffer_ptr > transcript_buffer) {
       conversion_flags_ &= ~TRANSCRIPT_FILE_START;
-      if (fd_ >= 0 &&
-          nosig_write(fd_, transcript_buffer, transcript_buffer_ptr - transcript_buffer) < 0) {
-        throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
-      }
-      written_size_ += transcript_buffer_ptr - transcript_buffer;
+      write_output(transcript_buffer, transcript_buffer_ptr - transcript_buffer);
     }
   }
 
@@ -79,8 +79,11 @@ class file_write_wrapper_t {
  private:
   int fd_, conversion_flags_;
   transcript_t *handle_;
+  std::string *output_ = nullptr;
   off_t written_size_ = 0;
 
+  void write_output(const char *buffer, size_t bytes);
+
  public:
   explicit file_write_wrapper_t(int fd, transcript_t *handle = nullptr)
       : fd_(fd),
@@ -90,7 +93,15 @@ class file_write_wrapper_t {
       transcript_from_unicode_reset(handle_);
     }
   }
+  // Create a wrapper which appends the converted data to @p output instead of writing to a file.
+  explicit file_write_wrapper_t(std::string *output, transcript_t *handle = nullptr)
+      : file_write_wrapper_t(-1, handle) {
+    output_ = output;
+  }
   void write(const char *buffer, size_t bytes);
+  // Convert as if the text does not start at the beginning of the file, e.g. without adding a
+  // byte-order mark.
+  void clear_file_start() { conversion_flags_ &= ~TRANSCRIPT_FILE_START; }
 
   // Get the state of the conversion flags. This may have changed from the initial setting by
   // imprecise conversions.
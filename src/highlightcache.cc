@@ -0,0 +1,145 @@
+#include "tilde/highlightcache.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <t3config/config.h>
+#include <utility>
+
+#include "tilde/log.h"
+#include "tilde/util.h"
+
+namespace {
+
+/* The number of unused patterns that are kept, such that closing the last file of a language and
+   then opening another one does not compile the patterns again. */
+const size_t max_unused_highlights = 8;
+
+typedef std::pair<std::string, int> highlight_key_t;
+
+struct shared_highlight_t {
+  t3_highlight_t *highlight;
+  int references;
+};
+
+std::map<highlight_key_t, shared_highlight_t> shared_highlights;
+std::map<const t3_highlight_t *, highlight_key_t> shared_highlight_keys;
+// Patterns without references, least recently used first.
+std::list<highlight_key_t> unused_highlights;
+
+}  // namespace
+
+t3_highlight_t *load_shared_highlight(const char *lang_file, int flags,
+                                      t3_highlight_error_t *error) {
+  highlight_key_t key(lang_file, flags & ~T3_HIGHLIGHT_VERBOSE_ERROR);
+
+  auto iter = shared_highlights.find(key);
+  if (iter != shared_highlights.end()) {
+    if (iter->second.references++ == 0) {
+      unused_highlights.remove(key);
+    }
+    return iter->second.highlight;
+  }
+
+  t3_highlight_t *highlight = t3_highlight_load(lang_file, map_highlight, nullptr, flags, error);
+  if (highlight == nullptr) {
+    return nullptr;
+  }
+  lprintf("Loaded highlighting patterns %s\n", lang_file);
+  shared_highlights[key] = shared_highlight_t{highlight, 1};
+  shared_highlight_keys[highlight] = key;
+  return highlight;
+}
+
+bool get_shared_highlight_source(const t3_highlight_t *highlight, std::string *lang_file,
+                                 int *flags) {
+  auto iter = shared_highlight_keys.find(highlight);
+  if (iter == shared_highlight_keys.end()) {
+    return false;
+  }
+  *lang_file = iter->second.first;
+  *flags = iter->second.second;
+  return true;
+}
+
+void release_shared_highlight(t3_highlight_t *highlight) {
+  if (highlight == nullptr) {
+    return;
+  }
+
+  auto key_iter = shared_highlight_keys.find(highlight);
+  if (key_iter == shared_highlight_keys.end()) {
+    t3_highlight_free(highlight);
+    return;
+  }
+
+  auto iter = shared_highlights.find(key_iter->second);
+  if (--iter->second.references > 0) {
+    return;
+  }
+  unused_highlights.push_back(iter->first);
+  if (unused_highlights.size() <= max_unused_highlights) {
+    return;
+  }
+
+  iter = shared_highlights.find(unused_highlights.front());
+  unused_highlights.pop_front();
+  shared_highlight_keys.erase(iter->second.highlight);
+  t3_highlight_free(iter->second.highlight);
+  shared_highlights.erase(iter);
+}
+
+std::vector<std::string> get_lang_search_path() {
+  std::vector<std::string> result;
+  std::unique_ptr<char, free_deleter> user_dir(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_DATA_HOME, "libt3highlight", 0));
+  if (user_dir != nullptr) {
+    result.push_back(user_dir.get());
+  }
+  const char *data_dirs = getenv("XDG_DATA_DIRS");
+  std::string dirs = data_dirs == nullptr || data_dirs[0] == 0 ? "/usr/local/share:/usr/share"
+                                                                : data_dirs;
+  for (size_t start = 0; start <= dirs.size();) {
+    size_t end = std::min(dirs.find(':', start), dirs.size());
+    if (end > start) {
+      result.push_back(dirs.substr(start, end - start) + "/libt3highlight");
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
+std::string get_lang_dirs_fingerprint(const std::vector<std::string> &dirs,
+                                      std::vector<std::string> *names) {
+  fnv_hash_t hash;
+  for (const std::string &dir : dirs) {
+    std::unique_ptr<DIR, int (*)(DIR *)> dir_handle(opendir(dir.c_str()), closedir);
+    if (dir_handle == nullptr) {
+      continue;
+    }
+    std::vector<std::string> dir_names;
+    while (struct dirent *entry = readdir(dir_handle.get())) {
+      dir_names.push_back(entry->d_name);
+    }
+    std::sort(dir_names.begin(), dir_names.end());
+    for (const std::string &name : dir_names) {
+      struct stat statbuf;
+      if (stat((dir + "/" + name).c_str(), &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+        continue;
+      }
+      if (names != nullptr) {
+        names->push_back(name);
+      }
+      std::string entry;
+      printf_into(&entry, "%s/%s %lld %ld\n", dir.c_str(), name.c_str(),
+                  static_cast<long long>(statbuf.st_size), static_cast<long>(statbuf.st_mtime));
+      hash.update(entry.data(), entry.size());
+    }
+  }
+  return hash.hex();
+}
@@ -0,0 +1,62 @@
+#ifndef HIGHLIGHTCACHE_H_
+#define HIGHLIGHTCACHE_H_
+
+#include <string>
+#include <t3highlight/highlight.h>
+#include <vector>
+
+/** The flags with which the highlighting patterns for buffers are loaded. All callers must use
+    these, such that the patterns for a language are shared between all buffers. */
+static const int kHighlightLoadFlags = T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH
+/* If T3_HIGHLIGHT_USE_SCOPE is not available, all the other code is still compatible, so we simply
+   omit the flag here. */
+#ifdef T3_HIGHLIGHT_USE_SCOPE
+                                      | T3_HIGHLIGHT_USE_SCOPE
+#endif
+    ;
+
+/** Load the highlighting patterns from @p lang_file, sharing them between all users.
+
+    The patterns loaded with the same @p flags are compiled only once, and every call returns a new
+    reference to the same t3_highlight_t. The patterns themselves are never modified by matching,
+    so users only need their own t3_highlight_match_t. T3_HIGHLIGHT_VERBOSE_ERROR only affects
+    the error reporting, and is therefore not taken into account when looking up the patterns.
+
+    Must only be called from the main thread.
+
+    @return A reference to the patterns, to be released with release_shared_highlight, or
+        @c nullptr on failure. In the latter case @p error is filled as for t3_highlight_load.
+*/
+t3_highlight_t *load_shared_highlight(const char *lang_file, int flags,
+                                      t3_highlight_error_t *error);
+
+/** Release a reference returned by load_shared_highlight.
+
+    When the last reference is released, the patterns are kept for a while in case they are
+    needed again, and freed once several other patterns have become unused since. Patterns that
+    were not loaded through load_shared_highlight are simply freed. @p highlight may be
+    @c nullptr.
+*/
+void release_shared_highlight(t3_highlight_t *highlight);
+
+/** Get the language file and flags that @p highlight was loaded with by load_shared_highlight.
+
+    @return @c false if @p highlight was not loaded by load_shared_highlight.
+*/
+bool get_shared_highlight_source(const t3_highlight_t *highlight, std::string *lang_file,
+                                 int *flags);
+
+/** Get the directories libt3highlight searches for language files: the user's directory in
+    $XDG_DATA_HOME, followed by the libt3highlight directory in each of $XDG_DATA_DIRS. */
+std::vector<std::string> get_lang_search_path();
+
+/** Get a hash of the names, sizes and modification times of the regular files in @p dirs.
+
+    Language files may include other language files, and the language map refers to them, so a
+    change to any of them is detected by comparing this hash rather than by following the
+    references. If @p names is not @c nullptr, the names of the files are appended to it.
+*/
+std::string get_lang_dirs_fingerprint(const std::vector<std::string> &dirs,
+                                      std::vector<std::string> *names);
+
+#endif
@@ -0,0 +1,175 @@
+#include "tilde/highlightcheckpoints.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tilde/highlightcache.h"
+#include "tilde/log.h"
+#include "tilde/util.h"
+
+namespace {
+
+const char kFileMagic[] = "tilde-highlight-checkpoints 2";
+// At most this many checkpoint files are kept. Files not written for kMaxAge seconds are removed.
+const size_t kMaxFiles = 512;
+const time_t kMaxAge = 90 * 24 * 60 * 60;
+
+#ifdef T3_HIGHLIGHT_VERSION
+const long kHighlightVersion = T3_HIGHLIGHT_VERSION;
+#else
+const long kHighlightVersion = 0;
+#endif
+
+/* Everything other than the contents that must be unchanged for the checkpoints to be valid. The
+   state numbers depend on the highlighting patterns and the version of libt3highlight. */
+struct checkpoint_key_t {
+  std::string path;
+  std::string lang_file;
+  int flags;
+  std::string lang_fingerprint;
+  long long size;
+  long mtime;
+};
+
+/* The fingerprint covers all files in the directories that are searched. Returns an empty
+   string if @p lang_file can not be found, in which case the patterns can not be verified. */
+std::string get_lang_fingerprint(const std::string &lang_file) {
+  std::vector<std::string> dirs;
+  std::string base_name = lang_file;
+  if (lang_file.find('/') != std::string::npos) {
+    dirs.push_back(lang_file.substr(0, lang_file.rfind('/')));
+    base_name = lang_file.substr(lang_file.rfind('/') + 1);
+  } else {
+    dirs = get_lang_search_path();
+  }
+
+  std::vector<std::string> names;
+  std::string fingerprint = get_lang_dirs_fingerprint(dirs, &names);
+  if (std::find(names.begin(), names.end(), base_name) == names.end()) {
+    return std::string();
+  }
+  return fingerprint;
+}
+
+bool get_checkpoint_key(file_buffer_t *file, checkpoint_key_t *key) {
+  if (file->get_name().empty() || file->get_highlight() == nullptr ||
+      !get_shared_highlight_source(file->get_highlight(), &key->lang_file, &key->flags)) {
+    return false;
+  }
+  key->path = canonicalize_path(file->get_name().c_str());
+  struct stat statbuf;
+  if (key->path.empty() || stat(key->path.c_str(), &statbuf) < 0) {
+    return false;
+  }
+  key->size = statbuf.st_size;
+  key->mtime = statbuf.st_mtime;
+  key->lang_fingerprint = get_lang_fingerprint(key->lang_file);
+  return !key->lang_fingerprint.empty();
+}
+
+std::string hash_block(file_buffer_t *file, text_pos_t block) {
+  fnv_hash_t hash;
+  for (text_pos_t i = (block - 1) * highlight_checkpoint_interval;
+       i < block * highlight_checkpoint_interval; ++i) {
+    const std::string &data = file->get_line_data(i).get_data();
+    hash.update(data.data(), data.size());
+    hash.update("\n", 1);
+  }
+  return hash.hex();
+}
+
+// The header holds the complete key, such that comparing headers compares all parts of the key.
+std::string make_header(const checkpoint_key_t &key) {
+  std::string numbers;
+  printf_into(&numbers, "%ld %d %s %lld %ld", kHighlightVersion, key.flags,
+              key.lang_fingerprint.c_str(), key.size, key.mtime);
+  return std::string(kFileMagic) + "\n" + numbers + "\n" + key.lang_file + "\n" + key.path + "\n";
+}
+
+}  // namespace
+
+void save_highlight_checkpoints(file_buffer_t *file,
+                                const std::vector<highlight_checkpoint_t> &checkpoints) {
+  checkpoint_key_t key;
+  if (checkpoints.empty() || file->is_modified() ||
+      file->size() < 4 * highlight_checkpoint_interval || !get_checkpoint_key(file, &key)) {
+    return;
+  }
+  std::string name = get_cache_file_name("highlight", key.path);
+  if (name.empty() || !make_dirs(name.substr(0, name.rfind('/')))) {
+    return;
+  }
+  // The directory is only scanned once per session, when the first checkpoints are stored.
+  static bool pruned = false;
+  if (!pruned) {
+    pruned = true;
+    prune_cache_dir(name.substr(0, name.rfind('/')), kMaxFiles, kMaxAge);
+  }
+
+  std::string temp_name = name + ".tmp";
+  std::unique_ptr<FILE, fclose_deleter> out(fopen(temp_name.c_str(), "w"));
+  if (out == nullptr) {
+    return;
+  }
+  fputs(make_header(key).c_str(), out.get());
+  // Every block up to the last checkpoint is listed, such that loading can check all of them.
+  auto checkpoint = checkpoints.begin();
+  text_pos_t last_block = checkpoints.back().line / highlight_checkpoint_interval;
+  for (text_pos_t block = 1; block <= last_block; ++block) {
+    int state = -1;
+    if (checkpoint != checkpoints.end() &&
+        checkpoint->line == block * highlight_checkpoint_interval) {
+      state = checkpoint->state;
+      ++checkpoint;
+    }
+    fprintf(out.get(), "%d %s\n", state, hash_block(file, block).c_str());
+  }
+  if (fclose(out.release()) != 0 || rename(temp_name.c_str(), name.c_str()) < 0) {
+    unlink(temp_name.c_str());
+    return;
+  }
+  lprintf("Stored %zd highlight checkpoints for %s\n", checkpoints.size(), key.path.c_str());
+}
+
+std::vector<highlight_checkpoint_t> load_highlight_checkpoints(file_buffer_t *file) {
+  std::vector<highlight_checkpoint_t> result;
+  checkpoint_key_t key;
+  if (file->size() < 4 * highlight_checkpoint_interval || !get_checkpoint_key(file, &key)) {
+    return result;
+  }
+  std::string name = get_cache_file_name("highlight", key.path);
+  if (name.empty()) {
+    return result;
+  }
+  std::unique_ptr<FILE, fclose_deleter> in(fopen(name.c_str(), "r"));
+  if (in == nullptr) {
+    return result;
+  }
+
+  std::string line, stored_header;
+  for (int i = 0; i < 4 && read_line(in.get(), &line); ++i) {
+    stored_header += line + "\n";
+  }
+  if (stored_header != make_header(key)) {
+    return result;
+  }
+
+  for (text_pos_t block = 1; read_line(in.get(), &line); ++block) {
+    int state;
+    char hash[17];
+    if (block * highlight_checkpoint_interval >= file->size() ||
+        sscanf(line.c_str(), "%d %16s", &state, hash) != 2 || hash_block(file, block) != hash) {
+      break;
+    }
+    if (state >= 0) {
+      result.push_back(highlight_checkpoint_t{block * highlight_checkpoint_interval, state});
+    }
+  }
+  lprintf("Loaded %zd highlight checkpoints for %s\n", result.size(), key.path.c_str());
+  return result;
+}
@@ -0,0 +1,36 @@
+#ifndef HIGHLIGHTCHECKPOINTS_H_
+#define HIGHLIGHTCHECKPOINTS_H_
+
+#include <vector>
+
+#include "tilde/filebuffer.h"
+
+/** The number of lines between highlighting checkpoints. */
+static const text_pos_t highlight_checkpoint_interval = 1024;
+
+struct highlight_checkpoint_t {
+  text_pos_t line;
+  int state;
+};
+
+/** Store the highlighting start states of some lines of @p file in the cache directory.
+
+    The checkpoints are stored in $XDG_CACHE_HOME/tilde/highlight, together with a hash of the
+    contents of every block of highlight_checkpoint_interval lines up to the last checkpoint. The
+    line of each checkpoint must be a multiple of highlight_checkpoint_interval.
+
+    Nothing is stored for modified or unnamed files, for small files, or if the language file can
+    not be found in the libt3highlight search path. Old checkpoint files are removed, such that
+    the directory does not grow without bound.
+*/
+void save_highlight_checkpoints(file_buffer_t *file,
+                                const std::vector<highlight_checkpoint_t> &checkpoints);
+
+/** Load the checkpoints stored by save_highlight_checkpoints for @p file.
+
+    Only checkpoints for which the highlighting patterns, the file and the contents of all lines
+    before the checkpoint are unchanged are returned.
+*/
+std::vector<highlight_checkpoint_t> load_highlight_checkpoints(file_buffer_t *file);
+
+#endif
@@ -0,0 +1,52 @@
+#include "tilde/highlightprogress.h"
+
+void highlight_progress_t::reset() {
+  valid = 0;
+  known = 0;
+  dirty_end = -1;
+}
+
+void highlight_progress_t::insert_lines(text_pos_t first, text_pos_t last) {
+  // The lines after the inserted lines keep their start states.
+  if (known >= first) {
+    known += last - first;
+    if (dirty_end >= first) {
+      dirty_end += last - first;
+    }
+    dirty_end = std::max(dirty_end, last - 1);
+  }
+  edited(first);
+}
+
+void highlight_progress_t::erase_lines(text_pos_t first, text_pos_t last) {
+  if (known >= last) {
+    known -= last - first;
+  } else if (known >= first) {
+    known = first - 1;
+  }
+  if (dirty_end >= last) {
+    dirty_end -= last - first;
+  } else if (dirty_end >= first) {
+    dirty_end = first - 1;
+  }
+  // The start state of the line after the deleted lines was computed from the last deleted line.
+  if (first <= known) {
+    dirty_end = std::max(dirty_end, first - 1);
+  }
+  edited(first);
+}
+
+void highlight_progress_t::change_line(text_pos_t line) {
+  // Edits after known need no tracking, as those lines have not been computed yet.
+  if (line <= known) {
+    dirty_end = std::max(dirty_end, line);
+  }
+  edited(line);
+}
+
+void highlight_progress_t::edited(text_pos_t line) {
+  if (line <= valid) {
+    valid = line - 1;
+  }
+  known = std::max(known, valid);
+}
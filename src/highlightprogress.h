@@ -0,0 +1,83 @@
+#ifndef HIGHLIGHTPROGRESS_H_
+#define HIGHLIGHTPROGRESS_H_
+
+#include <algorithm>
+#include <t3widget/util.h>
+
+using namespace t3widget;
+
+/** Tracks which of the highlighting start states of a buffer are up to date.
+
+    The start states of the lines up to and including valid are correct. The start states of the
+    lines after that up to known were computed before, but the end states of the lines up to and
+    including dirty_end may have changed since. After that, each start state still follows from
+    the end state of the line before it. Thus once the start state computed for a line after
+    dirty_end is unchanged, the start states up to known can be used without computing them
+    again.
+*/
+struct highlight_progress_t {
+  text_pos_t valid = 0;
+  text_pos_t known = 0;
+  text_pos_t dirty_end = -1;
+
+  /** Forget all start states but that of the first line, which is always the initial state. */
+  void reset();
+  /** Lines [@p first, @p last) were inserted. Their start states must be set to a placeholder. */
+  void insert_lines(text_pos_t first, text_pos_t last);
+  /** Lines [@p first, @p last) were deleted. */
+  void erase_lines(text_pos_t first, text_pos_t last);
+  /** The contents of @p line changed. */
+  void change_line(text_pos_t line);
+
+  /** Make the start states of the lines up to and including @p line valid.
+
+      @param size The number of lines in the buffer.
+      @param update_start Called as update_start(i), for lines i in ascending order, to compute
+          the start state of line i from the end state of line i - 1. Returns whether the start
+          state of line i changed.
+      @param update_range Called as update_range(i) before the first line i after known. Returns
+          @c true if it computed the start states of lines i through @p line itself, or @c false
+          to continue with update_start.
+  */
+  template <typename update_start_t, typename update_range_t>
+  void update(text_pos_t line, text_pos_t size, update_start_t update_start,
+              update_range_t update_range);
+
+ private:
+  void edited(text_pos_t line);
+};
+
+template <typename update_start_t, typename update_range_t>
+void highlight_progress_t::update(text_pos_t line, text_pos_t size, update_start_t update_start,
+                                  update_range_t update_range) {
+  if (valid >= line) {
+    return;
+  }
+  for (text_pos_t i = valid >= 0 ? valid + 1 : 1; i <= line; i++) {
+    if (i > known && update_range(i)) {
+      break;
+    }
+    bool changed = update_start(i);
+    if (!changed && i > dirty_end && i <= known) {
+      /* The edits did not change the state at the start of this unedited line, so the start
+         states of the lines after it are still the ones computed before the edits. */
+      valid = std::min(known, size - 1);
+      dirty_end = -1;
+      if (valid >= line) {
+        return;
+      }
+      i = valid;
+    }
+  }
+  valid = line;
+  if (line >= known) {
+    known = line;
+    dirty_end = -1;
+  } else {
+    /* Either the start state of line changed, or line is not after dirty_end. In both cases the
+       start state of the line after it may no longer follow from the end state of line. */
+    dirty_end = std::max(dirty_end, line);
+  }
+}
+
+#endif
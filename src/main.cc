@@ -30,11 +30,14 @@
 #include "tilde/dialogs/selectbufferdialog.h"
 #include "tilde/filebuffer.h"
 #include "tilde/fileeditwindow.h"
+#include "tilde/filestate.h"
 #include "tilde/log.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
 #include "tilde/option_access.h"
+#include "tilde/projectindex.h"
 #include "tilde/string_util.h"
+#include "tilde/worker_pool.h"
 
 using namespace t3widget;
 
@@ -88,6 +91,7 @@ class main_t : public main_window_base_t {
   void menu_activated(int id);
   void switch_buffer(file_buffer_t *buffer);
   void switch_to_new_buffer(stepped_process_t *process);
+  void goto_first_occurrence();
   void close_cb(stepped_process_t *process);
   void set_buffer_options();
   void set_default_options();
@@ -95,6 +99,7 @@ class main_t : public main_window_base_t {
   void set_misc_options();
   void set_highlight(t3_highlight_t *highlight, const char *name);
   void save_as_done(stepped_process_t *process);
+  void save_all_done(stepped_process_t *process);
 
   static key_bindings_t<action_id_t> key_bindings;
 };
@@ -114,6 +119,7 @@ key_bindings_t<action_id_t> main_t::key_bindings{
     {action_id_t::WINDOWS_HSPLIT, "HSplit", {EKEY_META | '5'}},
     {action_id_t::WINDOWS_VSPLIT, "VSplit", {EKEY_META | '\''}},
     {action_id_t::WINDOWS_MERGE, "MergeWindows", {EKEY_META | 'w'}},
+    {action_id_t::SEARCH_GOTO_FIRST_OCCURRENCE, "GotoFirstOccurrence", {EKEY_F12}},
 };
 
 main_t::main_t() {
@@ -128,6 +134,7 @@ main_t::main_t() {
   panel->insert_item(nullptr, "_Close", "^W", action_id_t::FILE_CLOSE);
   panel->insert_item(nullptr, "_Save", "^S", action_id_t::FILE_SAVE);
   panel->insert_item(nullptr, "Save _As...", "", action_id_t::FILE_SAVE_AS);
+  panel->insert_item(nullptr, "Save A_ll", "", action_id_t::FILE_SAVE_ALL);
   panel->insert_separator();
   panel->insert_item(nullptr, "Re_draw Screen", "", action_id_t::FILE_REPAINT);
   panel->insert_item(nullptr, "S_uspend", "M-Z", action_id_t::FILE_SUSPEND);
@@ -159,6 +166,8 @@ main_t::main_t() {
   panel->insert_item(nullptr, "_Go to Line...", "^G", action_id_t::SEARCH_GOTO);
   panel->insert_item(nullptr, "Go to matching _brace", "^]",
                      action_id_t::SEARCH_GOTO_MATCHING_BRACE);
+  panel->insert_item(nullptr, "Go to First _Occurrence", "F12",
+                     action_id_t::SEARCH_GOTO_FIRST_OCCURRENCE);
 
   panel = menu->insert_menu(nullptr, "_Window");
   panel->insert_item(nullptr, "_Next Buffer", "M-]", action_id_t::WINDOWS_NEXT_BUFFER);
@@ -360,6 +369,9 @@ void main_t::menu_activated(int id) {
       save_as_process_t::execute(bind_front(&main_t::save_as_done, this),
                                  get_current()->get_text());
       break;
+    case action_id_t::FILE_SAVE_ALL:
+      save_all_process_t::execute(bind_front(&main_t::save_all_done, this));
+      break;
     case action_id_t::FILE_OPEN_RECENT:
       open_recent_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this));
       break;
@@ -433,6 +445,9 @@ void main_t::menu_activated(int id) {
     case action_id_t::SEARCH_GOTO_MATCHING_BRACE:
       get_current()->goto_matching_brace();
       break;
+    case action_id_t::SEARCH_GOTO_FIRST_OCCURRENCE:
+      goto_first_occurrence();
+      break;
 
     case action_id_t::WINDOWS_NEXT_BUFFER: {
       file_edit_window_t *current = get_current();
@@ -567,6 +582,32 @@ void main_t::switch_to_new_buffer(stepped_process_t *process) {
   }
 }
 
+void main_t::goto_first_occurrence() {
+  std::string path;
+  text_pos_t line;
+  if (!find_project_first_occurrence(get_current()->get_text()->get_word_under_cursor(), &path,
+                                     &line)) {
+    return;
+  }
+
+  open_files_t::iterator iter = open_files.contains(path.c_str());
+  if (iter != open_files.end()) {
+    switch_buffer(*iter);
+    get_current()->jump_to_line(line + 1);
+    return;
+  }
+  load_process_t::execute(
+      [this, line](stepped_process_t *process) {
+        if (!process->get_result()) {
+          return;
+        }
+        switch_to_new_buffer(process);
+        switch_buffer(static_cast<load_process_t *>(process)->get_file_buffer());
+        get_current()->jump_to_line(line + 1);
+      },
+      path.c_str());
+}
+
 void main_t::close_cb(stepped_process_t *process) {
   file_buffer_t *text;
 
@@ -609,7 +650,7 @@ void main_t::set_misc_options() {
 }
 
 void main_t::set_highlight(t3_highlight_t *highlight, const char *name) {
-  get_current()->get_text()->set_highlight(highlight);
+  get_current()->get_text()->set_highlight(highlight, name);
   if (name == nullptr) {
     get_current()->get_text()->set_line_comment(nullptr);
   } else {
@@ -630,6 +671,13 @@ void main_t::save_as_done(stepped_process_t *process) {
   }
 }
 
+void main_t::save_all_done(stepped_process_t *process) {
+  (void)process;
+  for (auto *window : edit_windows) {
+    window->draw_info_window();
+  }
+}
+
 static void configure_input(bool cancel_selects_default) {
   input_selection_dialog_t *input_selection;
   int height, width, is_width, is_height;
@@ -893,8 +941,15 @@ int main(int argc, char *argv[]) {
   }
 
   load_cli_file_process_t::execute(bind_front(&main_t::load_cli_files_done, main_window));
+  start_project_index(cli_option.files);
   setup_signal_handlers();
   int retval = main_loop();
+  stop_project_index();
+  // Tasks may use the log and libt3widget, which do not outlive main.
+  worker_pool.shutdown();
+  for (file_buffer_t *file : open_files) {
+    file->save_checkpoints();
+  }
   if (option.save_recent_files) {
     recent_files.write_to_disk();
   }
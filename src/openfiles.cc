@@ -18,6 +18,7 @@
 #include <unistd.h>
 
 #include "tilde/filebuffer.h"
+#include "tilde/highlightcache.h"
 #include "tilde/log.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
@@ -122,7 +123,16 @@ file_buffer_t *open_files_t::previous_buffer(file_buffer_t *start) {
 recent_file_info_t::recent_file_info_t(const file_buffer_t *file)
     : recent_file_info_t(file->get_name(), file->get_encoding(), file->get_cursor(),
                          file->get_behavior_parameters()->get_top_left(),
-                         static_cast<int64_t>(std::time(nullptr))) {}
+                         static_cast<int64_t>(std::time(nullptr))) {
+  std::string lang_file;
+  int flags;
+  if (!get_shared_highlight_source(file->get_highlight(), &lang_file, &flags)) {
+    lang_file.clear();
+  }
+  // A language chosen by hand is not stored, as it would silently be reused on the next open.
+  set_language(file->get_language(), lang_file, file->get_line_comment(),
+               file->get_language_detected() ? file->get_detection_key() : std::string());
+}
 
 recent_file_info_t::recent_file_info_t(string_view _name, string_view _encoding,
                                        text_coordinate_t _position, text_coordinate_t _top_left,
@@ -138,6 +148,18 @@ const std::string &recent_file_info_t::get_encoding() const { return encoding; }
 text_coordinate_t recent_file_info_t::get_position() const { return position; }
 text_coordinate_t recent_file_info_t::get_top_left() const { return top_left; }
 int64_t recent_file_info_t::get_close_time() const { return close_time; }
+const std::string &recent_file_info_t::get_language() const { return language; }
+const std::string &recent_file_info_t::get_language_file() const { return language_file; }
+const std::string &recent_file_info_t::get_line_comment() const { return line_comment; }
+const std::string &recent_file_info_t::get_detection_key() const { return detection_key; }
+
+void recent_file_info_t::set_language(string_view _language, string_view _language_file,
+                                      string_view _line_comment, string_view _detection_key) {
+  language = std::string(_language);
+  language_file = std::string(_language_file);
+  line_comment = std::string(_line_comment);
+  detection_key = std::string(_detection_key);
+}
 
 void recent_files_t::push_front(const file_buffer_t *text) {
   if (text->get_name().empty()) {
@@ -268,6 +290,16 @@ void recent_files_t::load_from_disk() {
     int64_t close_time = t3_config_get_int64(t3_config_get(recent_file, "close-time"));
     recent_file_infos.push_back(
         make_unique<recent_file_info_t>(name, encoding, position, top_left, close_time));
+    const char *detection_key = t3_config_get_string(t3_config_get(recent_file, "detection-key"));
+    if (detection_key != nullptr) {
+      const char *language = t3_config_get_string(t3_config_get(recent_file, "language"));
+      const char *language_file =
+          t3_config_get_string(t3_config_get(recent_file, "language-file"));
+      const char *line_comment = t3_config_get_string(t3_config_get(recent_file, "line-comment"));
+      recent_file_infos.back()->set_language(
+          language == nullptr ? "" : language, language_file == nullptr ? "" : language_file,
+          line_comment == nullptr ? "" : line_comment, detection_key);
+    }
   }
   std::sort(recent_file_infos.begin(), recent_file_infos.end(),
             [](const std::unique_ptr<recent_file_info_t> &a,
@@ -278,21 +310,22 @@ void recent_files_t::load_from_disk() {
   lprintf("Loaded %zd recent files\n", recent_file_infos.size());
 }
 
-static bool make_dirs(char *dir) {
-  char *slash = strchr(dir + (dir[0] == '/'), '/');
-
-  while (slash != nullptr) {
-    *slash = 0;
-    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
-      return false;
-    }
-    *slash = '/';
-    slash = strchr(slash + 1, '/');
-  }
-  if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
-    return false;
-  }
-  return true;
+static int add_language_config(t3_config_t *config, const recent_file_info_t *info) {
+  if (info->get_detection_key().empty()) {
+    t3_config_erase(config, "language");
+    t3_config_erase(config, "language-file");
+    t3_config_erase(config, "line-comment");
+    t3_config_erase(config, "detection-key");
+    return 0;
+  }
+  int combined_result = 0;
+  combined_result |= t3_config_add_string(config, "language", info->get_language().c_str());
+  combined_result |=
+      t3_config_add_string(config, "language-file", info->get_language_file().c_str());
+  combined_result |= t3_config_add_string(config, "line-comment", info->get_line_comment().c_str());
+  combined_result |=
+      t3_config_add_string(config, "detection-key", info->get_detection_key().c_str());
+  return combined_result;
 }
 
 void recent_files_t::write_to_disk() {
@@ -401,6 +434,7 @@ void recent_files_t::write_to_disk() {
           t3_config_add_int64(position_list, nullptr, recent_file->get_top_left().pos);
       combined_result |=
           t3_config_add_int64(new_recent_file, "close-time", recent_file->get_close_time());
+      combined_result |= add_language_config(new_recent_file, recent_file.get());
       if (combined_result != 0) {
         lprintf("Error in adding a new item to the recent-files list");
         return;
@@ -416,6 +450,7 @@ void recent_files_t::write_to_disk() {
         t3_config_add_int64(position_list, nullptr, recent_file->get_position().pos);
         t3_config_add_int64(position_list, nullptr, recent_file->get_top_left().line);
         t3_config_add_int64(position_list, nullptr, recent_file->get_top_left().pos);
+        add_language_config(existing_iter->second, recent_file.get());
       }
     }
   }
@@ -58,17 +58,30 @@ class recent_file_info_t {
   text_coordinate_t position;
   text_coordinate_t top_left;
   int64_t close_time;
+  /* The highlighting language used for the file, such that the language detection can be skipped
+     when the file is opened again. Only valid while the file's detection key is unchanged. An
+     empty language_file means that no highlighting was used. */
+  std::string language;
+  std::string language_file;
+  std::string line_comment;
+  std::string detection_key;
 
  public:
   explicit recent_file_info_t(const file_buffer_t *file);
   recent_file_info_t(string_view name, string_view encoding, text_coordinate_t position,
                      text_coordinate_t top_left, int64_t close_time);
+  void set_language(string_view _language, string_view _language_file, string_view _line_comment,
+                    string_view _detection_key);
 
   const std::string &get_name() const;
   const std::string &get_encoding() const;
   text_coordinate_t get_position() const;
   text_coordinate_t get_top_left() const;
   int64_t get_close_time() const;
+  const std::string &get_language() const;
+  const std::string &get_language_file() const;
+  const std::string &get_line_comment() const;
+  const std::string &get_detection_key() const;
 };
 
 class recent_files_t {
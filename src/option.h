@@ -95,6 +95,10 @@ struct options_t {
 
   optional<int> tabsize;
   optional<size_t> max_recent_files;
+  optional<size_t> backup_versions;
+  optional<size_t> backup_store_size;
+  optional<size_t> max_highlight_line_length;
+  optional<size_t> max_project_files;
 };
 
 struct runtime_options_t {
@@ -111,6 +115,10 @@ struct runtime_options_t {
   bool save_recent_files;
   bool restore_cursor_position;
   size_t max_recent_files;
+  size_t backup_versions;
+  size_t backup_store_size;
+  size_t max_highlight_line_length;
+  size_t max_project_files;
   optional<int> key_timeout;
   attribute_map_t highlights;
   t3_attr_t brace_highlight;
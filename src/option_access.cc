@@ -64,6 +64,14 @@ option_access_t option_access[] = {
     option_access_t("tabsize", &runtime_options_t::tabsize, &options_t::tabsize, 8),
     option_access_t("max_recent_files", &runtime_options_t::max_recent_files,
                     &options_t::max_recent_files, 16),
+    option_access_t("backup_versions", &runtime_options_t::backup_versions,
+                    &options_t::backup_versions, 0),
+    option_access_t("backup_store_size", &runtime_options_t::backup_store_size,
+                    &options_t::backup_store_size, 256),
+    option_access_t("max_highlight_line_length", &runtime_options_t::max_highlight_line_length,
+                    &options_t::max_highlight_line_length, 65536),
+    option_access_t("max_project_files", &runtime_options_t::max_project_files,
+                    &options_t::max_project_files, 100000),
     option_access_t("key_timeout", &runtime_options_t::key_timeout, &term_options_t::key_timeout),
 
     option_access_t("brace_highlight", &runtime_options_t::brace_highlight,
@@ -0,0 +1,142 @@
+#include "tilde/parallelencode.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <transcript/transcript.h>
+
+#include "tilde/filebuffer.h"
+#include "tilde/filewrapper.h"
+#include "tilde/worker_pool.h"
+
+namespace {
+
+// Converting fewer bytes than this is faster on the main thread alone.
+const size_t kMinParallelSize = 256 * 1024;
+// The number of UTF-8 bytes to convert per block.
+const size_t kBlockSize = 64 * 1024;
+
+/* Prefixes of the normalized names of encodings that have no shift states. For all of these,
+   converting a line does not depend on the lines before it. Encodings not listed here, such as
+   ISO-2022 and UTF-7, are converted by a single converter. */
+const char *const kStatelessPrefixes[] = {"utf16", "utf32", "ucs2", "ucs4", "iso8859", "latin",
+                                          "windows125", "cp125", "koi8", "ascii", "usascii",
+                                          "ibm437", "cp437", "ibm850", "cp850"};
+
+bool is_stateless_encoding(const char *encoding) {
+  char normalized[64];
+  transcript_normalize_name(encoding, normalized, sizeof(normalized));
+  for (const char *prefix : kStatelessPrefixes) {
+    if (strncmp(normalized, prefix, strlen(prefix)) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The converters can not be shared between threads. As run_parallel runs at most one index per
+   thread at a time, a converter per thread suffices. */
+class converter_pool_t {
+ public:
+  ~converter_pool_t() {
+    for (transcript_t *handle : handles) {
+      transcript_close_converter(handle);
+    }
+  }
+  transcript_t *acquire() {
+    std::unique_lock<std::mutex> guard(lock);
+    transcript_t *handle = handles.back();
+    handles.pop_back();
+    return handle;
+  }
+  void release(transcript_t *handle) {
+    std::unique_lock<std::mutex> guard(lock);
+    handles.push_back(handle);
+  }
+
+  std::vector<transcript_t *> handles;
+
+ private:
+  std::mutex lock;
+};
+
+}  // namespace
+
+bool can_encode_in_parallel(file_buffer_t *file, const char *encoding) {
+  if (worker_pool.get_max_threads() < 2 || !is_stateless_encoding(encoding)) {
+    return false;
+  }
+  size_t total_size = 0;
+  for (text_pos_t i = 0; i < file->size() && total_size < kMinParallelSize; ++i) {
+    total_size += file->get_line_data(i).get_data().size() + 1;
+  }
+  return total_size >= kMinParallelSize;
+}
+
+rw_result_t encode_in_parallel(file_buffer_t *file, const char *encoding,
+                               std::vector<std::string> *blocks, bool *imprecise) {
+  // Each block starts at a line, and includes the newline that precedes it.
+  std::vector<text_pos_t> block_starts;
+  size_t block_size = kBlockSize;
+  for (text_pos_t i = 0; i < file->size(); ++i) {
+    if (block_size >= kBlockSize) {
+      block_starts.push_back(i);
+      block_size = 0;
+    }
+    block_size += file->get_line_data(i).get_data().size() + 1;
+  }
+  block_starts.push_back(file->size());
+  size_t block_count = block_starts.size() - 1;
+
+  converter_pool_t converters;
+  size_t converter_count = std::min(block_count, worker_pool.get_max_threads());
+  for (size_t i = 0; i < converter_count; ++i) {
+    transcript_error_t error;
+    transcript_t *handle = transcript_open_converter(encoding, TRANSCRIPT_UTF8, 0, &error);
+    if (handle == nullptr) {
+      return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+    }
+    converters.handles.push_back(handle);
+  }
+
+  blocks->assign(block_count, std::string());
+  std::vector<rw_result_t> results(block_count, rw_result_t(rw_result_t::SUCCESS, 0));
+  // Not std::vector<bool>, as that can not be written from multiple threads.
+  std::vector<char> block_imprecise(block_count, false);
+
+  worker_pool.run_parallel(block_count, [&](size_t block) {
+    transcript_t *handle = converters.acquire();
+    file_write_wrapper_t wrapper(&(*blocks)[block], handle);
+    // Only the start of the file may get a byte-order mark.
+    if (block != 0) {
+      wrapper.clear_file_start();
+    }
+    for (text_pos_t i = block_starts[block]; i < block_starts[block + 1]; ++i) {
+      try {
+        if (i != 0) {
+          wrapper.write("\n", 1);
+        }
+        const std::string &data = file->get_line_data(i).get_data();
+        wrapper.write(data.data(), data.size());
+      } catch (rw_result_t error) {
+        // The wrapper has converted the whole line using fallbacks, and will use them from now on.
+        if (error != rw_result_t::CONVERSION_IMPRECISE) {
+          results[block] = error;
+          break;
+        }
+        block_imprecise[block] = true;
+      }
+    }
+    converters.release(handle);
+  });
+
+  *imprecise = false;
+  for (size_t i = 0; i < block_count; ++i) {
+    if (results[i] != rw_result_t::SUCCESS) {
+      blocks->clear();
+      return results[i];
+    }
+    *imprecise |= block_imprecise[i] != 0;
+  }
+  return rw_result_t(rw_result_t::SUCCESS, 0);
+}
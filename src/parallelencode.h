@@ -0,0 +1,31 @@
+#ifndef PARALLELENCODE_H_
+#define PARALLELENCODE_H_
+
+#include <string>
+#include <vector>
+
+#include "tilde/filestate.h"
+
+class file_buffer_t;
+
+/** Returns whether @p file is best converted to @p encoding using encode_in_parallel.
+
+    This is only the case for encodings without shift states, such that blocks of lines can be
+    converted independently, and for files large enough to make this worth the overhead.
+*/
+bool can_encode_in_parallel(file_buffer_t *file, const char *encoding);
+
+/** Convert the contents of @p file to @p encoding, converting blocks of lines concurrently.
+
+    The result is the same as when the lines are converted in order by file_write_wrapper_t,
+    except that imprecise conversions do not stop the conversion. Instead all blocks are
+    converted using fallbacks, and @p imprecise is set to allow the caller to ask the user before
+    writing anything. The file must not be modified until this returns, as it is read by the
+    worker threads.
+
+    @param blocks Filled with the converted blocks, which must be written in order.
+*/
+rw_result_t encode_in_parallel(file_buffer_t *file, const char *encoding,
+                               std::vector<std::string> *blocks, bool *imprecise);
+
+#endif
@@ -0,0 +1,467 @@
+#include "tilde/projectindex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <t3config/config.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "tilde/log.h"
+#include "tilde/option.h"
+#include "tilde/util.h"
+#include "tilde/wordindex.h"
+#include "tilde/worker_pool.h"
+
+namespace {
+
+const char kFileMagic[] = "tilde-project-index 1";
+// Files larger than this are not indexed.
+const off_t kMaxFileSize = 1024 * 1024;
+/* The number of files read in one run_parallel call. Keeping this small allows other work
+   submitted to the worker pool to run in between. */
+const size_t kBatchSize = 256;
+// At most this many project indexes are kept. Indexes not written for kMaxAge seconds are removed.
+const size_t kMaxProjects = 16;
+const time_t kMaxAge = 60 * 24 * 60 * 60;
+
+// The words in a file, as pairs of a word id and the 0-based line of the first occurrence.
+struct file_entry_t {
+  long mtime = 0;
+  long long size = -1;
+  std::vector<std::pair<uint32_t, uint32_t>> words;
+};
+
+struct project_t {
+  std::string root;
+  // The paths of the files relative to root, in the order in which they are searched.
+  std::vector<std::string> paths;
+  std::vector<file_entry_t> entries;
+};
+
+/* The index used for lookups. It is immutable once published, such that lookups only need to
+   hold the lock while copying the pointer. */
+struct project_index_t {
+  struct location_t {
+    uint32_t file;
+    uint32_t line;
+  };
+  std::vector<std::string> files;
+  // All words, sorted, with the location of the first occurrence of words[i] in occurrences[i].
+  std::vector<std::string> words;
+  std::vector<location_t> occurrences;
+};
+
+std::mutex index_lock;
+std::shared_ptr<const project_index_t> current_index;
+std::atomic<bool> stop_requested(false);
+// Only accessed from the main thread.
+bool index_started = false;
+
+std::shared_ptr<const project_index_t> get_index() {
+  std::unique_lock<std::mutex> guard(index_lock);
+  return current_index;
+}
+
+class project_indexer_t {
+ public:
+  project_indexer_t(const std::vector<std::string> &_roots, size_t max_files)
+      : roots(_roots), file_budget(max_files) {}
+  void run();
+
+ private:
+  uint32_t intern(const std::string &word);
+  void load_cache(const std::string &root, std::map<std::string, file_entry_t> *cached);
+  void write_cache(const project_t &project);
+  void walk(const std::string &root, const std::string &dir, project_t *project,
+            std::vector<struct stat> *stats);
+  void index_files(project_t *project, const std::vector<struct stat> &stats,
+                   std::map<std::string, file_entry_t> *cached);
+  bool read_words(const std::string &path, file_entry_t *entry);
+  void publish(const std::vector<project_t> &projects);
+
+  std::vector<std::string> roots;
+  size_t file_budget;
+  bool pruned = false;
+
+  // The words of all files, by id. Protected by word_lock while reading files in parallel.
+  std::mutex word_lock;
+  std::vector<std::string> words;
+  std::unordered_map<std::string, uint32_t> word_ids;
+};
+
+uint32_t project_indexer_t::intern(const std::string &word) {
+  auto result = word_ids.insert({word, static_cast<uint32_t>(words.size())});
+  if (result.second) {
+    words.push_back(word);
+  }
+  return result.first->second;
+}
+
+/* The index is stored as the list of words, followed by a header line and a line of word ids and
+   line numbers for each file. The words are listed once, such that the entries for the files
+   only contain numbers. */
+void project_indexer_t::load_cache(const std::string &root,
+                                   std::map<std::string, file_entry_t> *cached) {
+  std::string name = get_cache_file_name("projects", root);
+  if (name.empty()) {
+    return;
+  }
+  std::unique_ptr<FILE, fclose_deleter> in(fopen(name.c_str(), "r"));
+  if (in == nullptr) {
+    return;
+  }
+
+  std::string line;
+  if (!read_line(in.get(), &line) || line != kFileMagic || !read_line(in.get(), &line) ||
+      line != root || !read_line(in.get(), &line)) {
+    return;
+  }
+  unsigned long word_count = strtoul(line.c_str(), nullptr, 10);
+  std::vector<uint32_t> ids;
+  for (unsigned long i = 0; i < word_count; ++i) {
+    if (stop_requested || !read_line(in.get(), &line)) {
+      return;
+    }
+    ids.push_back(intern(line));
+  }
+
+  while (!stop_requested && read_line(in.get(), &line)) {
+    file_entry_t entry;
+    int path_start;
+    if (sscanf(line.c_str(), "F %ld %lld %n", &entry.mtime, &entry.size, &path_start) != 2) {
+      break;
+    }
+    std::string path = line.substr(path_start);
+    if (!read_line(in.get(), &line)) {
+      break;
+    }
+    char *ptr = &line[0];
+    char *end;
+    while (true) {
+      unsigned long id = strtoul(ptr, &end, 10);
+      if (end == ptr || id >= ids.size()) {
+        break;
+      }
+      ptr = end;
+      unsigned long word_line = strtoul(ptr, &end, 10);
+      if (end == ptr) {
+        break;
+      }
+      ptr = end;
+      entry.words.push_back({ids[id], static_cast<uint32_t>(word_line)});
+    }
+    (*cached)[path] = std::move(entry);
+  }
+}
+
+void project_indexer_t::write_cache(const project_t &project) {
+  std::string name = get_cache_file_name("projects", project.root);
+  if (name.empty() || !make_dirs(name.substr(0, name.rfind('/')))) {
+    return;
+  }
+  if (!pruned) {
+    pruned = true;
+    prune_cache_dir(name.substr(0, name.rfind('/')), kMaxProjects, kMaxAge);
+  }
+
+  // Only the words that occur in the project are written, numbered in order of appearance.
+  std::vector<uint32_t> file_ids(words.size(), UINT32_MAX);
+  std::vector<uint32_t> used_words;
+  for (const file_entry_t &entry : project.entries) {
+    for (const std::pair<uint32_t, uint32_t> &word : entry.words) {
+      if (file_ids[word.first] == UINT32_MAX) {
+        file_ids[word.first] = used_words.size();
+        used_words.push_back(word.first);
+      }
+    }
+  }
+
+  std::string temp_name = name + ".tmp";
+  std::unique_ptr<FILE, fclose_deleter> out(fopen(temp_name.c_str(), "w"));
+  if (out == nullptr) {
+    return;
+  }
+  fprintf(out.get(), "%s\n%s\n%zd\n", kFileMagic, project.root.c_str(), used_words.size());
+  for (uint32_t id : used_words) {
+    fprintf(out.get(), "%s\n", words[id].c_str());
+  }
+  for (size_t i = 0; i < project.paths.size(); ++i) {
+    const file_entry_t &entry = project.entries[i];
+    fprintf(out.get(), "F %ld %lld %s\n", entry.mtime, entry.size, project.paths[i].c_str());
+    for (const std::pair<uint32_t, uint32_t> &word : entry.words) {
+      fprintf(out.get(), "%u %u ", file_ids[word.first], word.second);
+    }
+    fputc('\n', out.get());
+  }
+  if (fclose(out.release()) != 0 || rename(temp_name.c_str(), name.c_str()) < 0) {
+    unlink(temp_name.c_str());
+    return;
+  }
+  lprintf("Stored project index for %s (%zd files)\n", project.root.c_str(),
+          project.paths.size());
+}
+
+/* The files in a directory are listed before the files in its sub-directories, such that the
+   first occurrence of a word is preferably in a file closer to the root. */
+void project_indexer_t::walk(const std::string &root, const std::string &dir, project_t *project,
+                             std::vector<struct stat> *stats) {
+  std::unique_ptr<DIR, int (*)(DIR *)> dir_handle(opendir((root + "/" + dir).c_str()), closedir);
+  if (dir_handle == nullptr) {
+    return;
+  }
+  std::vector<std::string> names;
+  while (struct dirent *entry = readdir(dir_handle.get())) {
+    if (entry->d_name[0] != '.' && strchr(entry->d_name, '\n') == nullptr) {
+      names.push_back(entry->d_name);
+    }
+  }
+  dir_handle.reset();
+  std::sort(names.begin(), names.end());
+
+  std::vector<std::string> sub_dirs;
+  for (const std::string &name : names) {
+    if (file_budget == 0 || stop_requested) {
+      return;
+    }
+    std::string path = dir + name;
+    struct stat statbuf;
+    if (lstat((root + "/" + path).c_str(), &statbuf) < 0) {
+      continue;
+    }
+    if (S_ISDIR(statbuf.st_mode)) {
+      sub_dirs.push_back(path + "/");
+    } else if (S_ISREG(statbuf.st_mode) && statbuf.st_size <= kMaxFileSize) {
+      project->paths.push_back(path);
+      stats->push_back(statbuf);
+      --file_budget;
+    }
+  }
+  for (const std::string &sub_dir : sub_dirs) {
+    walk(root, sub_dir, project, stats);
+  }
+}
+
+void project_indexer_t::index_files(project_t *project, const std::vector<struct stat> &stats,
+                                    std::map<std::string, file_entry_t> *cached) {
+  std::vector<size_t> changed;
+  project->entries.resize(project->paths.size());
+  for (size_t i = 0; i < project->paths.size(); ++i) {
+    file_entry_t &entry = project->entries[i];
+    entry.mtime = stats[i].st_mtime;
+    entry.size = stats[i].st_size;
+    auto iter = cached->find(project->paths[i]);
+    if (iter != cached->end() && iter->second.mtime == entry.mtime &&
+        iter->second.size == entry.size) {
+      entry.words = std::move(iter->second.words);
+    } else {
+      changed.push_back(i);
+    }
+  }
+  cached->clear();
+  lprintf("Reading %zd of %zd files in %s\n", changed.size(), project->paths.size(),
+          project->root.c_str());
+
+  for (size_t batch = 0; batch < changed.size() && !stop_requested; batch += kBatchSize) {
+    worker_pool.run_parallel(std::min(kBatchSize, changed.size() - batch),
+                             [this, project, &changed, batch](size_t idx) {
+                               size_t file = changed[batch + idx];
+                               if (stop_requested) {
+                                 return;
+                               }
+                               if (!read_words(project->root + "/" + project->paths[file],
+                                               &project->entries[file])) {
+                                 // Make sure the file is read again next time.
+                                 project->entries[file].size = -1;
+                               }
+                             });
+  }
+}
+
+bool project_indexer_t::read_words(const std::string &path, file_entry_t *entry) {
+  std::unique_ptr<FILE, fclose_deleter> in(fopen(path.c_str(), "r"));
+  if (in == nullptr) {
+    return false;
+  }
+  std::string data;
+  char buffer[16384];
+  size_t bytes_read;
+  while ((bytes_read = fread(buffer, 1, sizeof(buffer), in.get())) > 0 && !stop_requested) {
+    data.append(buffer, bytes_read);
+  }
+  if (ferror(in.get()) || stop_requested) {
+    return false;
+  }
+  // Binary files are stored without words, such that they are not read again.
+  if (memchr(data.data(), 0, data.size()) != nullptr) {
+    return true;
+  }
+
+  // Words are split in the same way as for the word indexes of the open files.
+  std::map<std::string, uint32_t> first_lines;
+  std::vector<string_view> line_words;
+  uint32_t line_number = 0;
+  for (size_t start = 0; start < data.size(); ++line_number) {
+    size_t end = std::min(data.find('\n', start), data.size());
+    line_words.clear();
+    split_words(string_view(data).substr(start, end - start), &line_words);
+    for (string_view word : line_words) {
+      first_lines.insert({std::string(word), line_number});
+    }
+    start = end + 1;
+  }
+
+  std::unique_lock<std::mutex> guard(word_lock);
+  for (const std::pair<const std::string, uint32_t> &word : first_lines) {
+    entry->words.push_back({intern(word.first), word.second});
+  }
+  return true;
+}
+
+void project_indexer_t::publish(const std::vector<project_t> &projects) {
+  static const project_index_t::location_t no_location = {UINT32_MAX, 0};
+  std::vector<project_index_t::location_t> first_occurrences(words.size(), no_location);
+  std::shared_ptr<project_index_t> index = std::make_shared<project_index_t>();
+
+  for (const project_t &project : projects) {
+    for (size_t i = 0; i < project.paths.size(); ++i) {
+      uint32_t file = index->files.size();
+      index->files.push_back(project.root + "/" + project.paths[i]);
+      for (const std::pair<uint32_t, uint32_t> &word : project.entries[i].words) {
+        if (first_occurrences[word.first].file == UINT32_MAX) {
+          first_occurrences[word.first] = project_index_t::location_t{file, word.second};
+        }
+      }
+    }
+  }
+
+  std::vector<uint32_t> sorted_ids;
+  for (uint32_t id = 0; id < first_occurrences.size(); ++id) {
+    if (first_occurrences[id].file != UINT32_MAX) {
+      sorted_ids.push_back(id);
+    }
+  }
+  std::sort(sorted_ids.begin(), sorted_ids.end(),
+            [this](uint32_t a, uint32_t b) { return words[a] < words[b]; });
+  index->words.reserve(sorted_ids.size());
+  index->occurrences.reserve(sorted_ids.size());
+  for (uint32_t id : sorted_ids) {
+    index->words.push_back(words[id]);
+    index->occurrences.push_back(first_occurrences[id]);
+  }
+
+  lprintf("Project index: %zd words in %zd files\n", index->words.size(), index->files.size());
+  std::unique_lock<std::mutex> guard(index_lock);
+  current_index = std::move(index);
+}
+
+void project_indexer_t::run() {
+  std::vector<std::map<std::string, file_entry_t>> cached(roots.size());
+  std::vector<project_t> projects(roots.size());
+  for (size_t i = 0; i < roots.size(); ++i) {
+    load_cache(roots[i], &cached[i]);
+    // Make the cached words available while the directories are walked.
+    projects[i].root = roots[i];
+    for (const std::pair<const std::string, file_entry_t> &file : cached[i]) {
+      projects[i].paths.push_back(file.first);
+      projects[i].entries.push_back(file.second);
+    }
+  }
+  if (stop_requested) {
+    return;
+  }
+  publish(projects);
+
+  for (size_t i = 0; i < roots.size() && !stop_requested; ++i) {
+    project_t &project = projects[i];
+    std::vector<struct stat> stats;
+    project.paths.clear();
+    project.entries.clear();
+    walk(project.root, std::string(), &project, &stats);
+    index_files(&project, stats, &cached[i]);
+    if (!stop_requested) {
+      write_cache(project);
+    }
+  }
+  if (!stop_requested) {
+    publish(projects);
+  }
+}
+
+}  // namespace
+
+void start_project_index(const std::vector<std::string> &files) {
+  if (index_started || option.max_project_files == 0) {
+    return;
+  }
+
+  const char *home = getenv("HOME");
+  std::string home_dir = home == nullptr ? std::string() : canonicalize_path(home);
+  std::vector<std::string> roots;
+  for (const std::string &file : files) {
+    size_t slash = file.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : file.substr(0, slash);
+    dir = canonicalize_path(dir.c_str());
+    if (!dir.empty() && dir != "/" && dir != home_dir) {
+      roots.push_back(dir);
+    }
+  }
+  // Directories inside another root are already covered by that root.
+  std::sort(roots.begin(), roots.end());
+  std::vector<std::string> unique_roots;
+  for (const std::string &root : roots) {
+    if (unique_roots.empty() || (root != unique_roots.back() &&
+                                 root.compare(0, unique_roots.back().size() + 1,
+                                              unique_roots.back() + "/") != 0)) {
+      unique_roots.push_back(root);
+    }
+  }
+  if (unique_roots.empty()) {
+    return;
+  }
+
+  index_started = true;
+  std::shared_ptr<project_indexer_t> indexer =
+      std::make_shared<project_indexer_t>(unique_roots, option.max_project_files);
+  worker_pool.submit([indexer] { indexer->run(); });
+}
+
+void stop_project_index() { stop_requested = true; }
+
+void find_project_words(string_view prefix, size_t limit, std::vector<std::string> *words) {
+  std::shared_ptr<const project_index_t> index = get_index();
+  if (index == nullptr) {
+    return;
+  }
+  std::string prefix_str(prefix);
+  for (auto iter = std::lower_bound(index->words.begin(), index->words.end(), prefix_str);
+       iter != index->words.end() && limit > 0 &&
+       iter->compare(0, prefix_str.size(), prefix_str) == 0;
+       ++iter, --limit) {
+    words->push_back(*iter);
+  }
+}
+
+bool find_project_first_occurrence(string_view word, std::string *path, text_pos_t *line) {
+  std::shared_ptr<const project_index_t> index = get_index();
+  if (index == nullptr) {
+    return false;
+  }
+  std::string word_str(word);
+  auto iter = std::lower_bound(index->words.begin(), index->words.end(), word_str);
+  if (iter == index->words.end() || *iter != word_str) {
+    return false;
+  }
+  const project_index_t::location_t &location = index->occurrences[iter - index->words.begin()];
+  *path = index->files[location.file];
+  *line = location.line;
+  return true;
+}
@@ -0,0 +1,41 @@
+#ifndef PROJECTINDEX_H_
+#define PROJECTINDEX_H_
+
+#include <string>
+#include <t3widget/textline.h>
+#include <vector>
+
+using namespace t3widget;
+
+/** Index the words in the files in the directories of @p files on a worker thread.
+
+    The directories are walked recursively, skipping hidden files and directories, symbolic links,
+    large files and binary files. At most option.max_project_files files are indexed, and setting
+    that option to 0 disables the index. The home directory and the root directory are never
+    walked. Words are split in the same way as for autocompletion.
+
+    For each directory, the words in each file are stored in $XDG_CACHE_HOME/tilde/projects,
+    together with the size and modification time of the file. The next time the directory is
+    indexed, only the files that changed are read. The cached words are available for lookups
+    while the directories are walked.
+*/
+void start_project_index(const std::vector<std::string> &files);
+
+/** Ask the indexer started by start_project_index to stop, without updating the cache. The
+    indexer checks for this between files and while reading a file, so it finishes quickly. This
+    does not wait for it: call worker_pool_t::shutdown for that. */
+void stop_project_index();
+
+/** Append at most @p limit words from the project index that start with @p prefix to @p words,
+    in sorted order. */
+void find_project_words(string_view prefix, size_t limit, std::vector<std::string> *words);
+
+/** Find the location of the first occurrence of @p word in the project index.
+
+    Files are ordered by path, with the files in a directory before those in its sub-directories.
+    As the index does not know about the syntax of the files, this is not necessarily the
+    definition of the word. The line is 0-based.
+*/
+bool find_project_first_occurrence(string_view word, std::string *path, text_pos_t *line);
+
+#endif
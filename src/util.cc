@@ -11,14 +11,18 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <csignal>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <dirent.h>
+#include <memory>
 #include <string>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -122,6 +126,64 @@ void fatal(const char *fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
+bool make_dirs(const std::string &dir) {
+  size_t slash = dir.find('/', dir[0] == '/' ? 1 : 0);
+
+  while (slash != std::string::npos) {
+    if (mkdir(dir.substr(0, slash).c_str(), 0777) == -1 && errno != EEXIST) {
+      return false;
+    }
+    slash = dir.find('/', slash + 1);
+  }
+  if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST) {
+    return false;
+  }
+  return true;
+}
+
+bool read_line(FILE *in, std::string *line) {
+  line->clear();
+  int c;
+  while ((c = getc(in)) != EOF && c != '\n') {
+    line->push_back(static_cast<char>(c));
+  }
+  return c == '\n';
+}
+
+std::string get_cache_file_name(const char *dir, const std::string &key) {
+  std::unique_ptr<char, free_deleter> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0));
+  if (xdg_path == nullptr) {
+    return std::string();
+  }
+  fnv_hash_t key_hash;
+  key_hash.update(key.data(), key.size());
+  return std::string(xdg_path.get()) + "/" + dir + "/" + key_hash.hex();
+}
+
+void prune_cache_dir(const std::string &dir, size_t max_files, time_t max_age) {
+  std::unique_ptr<DIR, int (*)(DIR *)> dir_handle(opendir(dir.c_str()), closedir);
+  if (dir_handle == nullptr) {
+    return;
+  }
+  std::vector<std::pair<time_t, std::string>> files;
+  while (struct dirent *entry = readdir(dir_handle.get())) {
+    std::string name = dir + "/" + entry->d_name;
+    struct stat statbuf;
+    if (entry->d_name[0] != '.' && stat(name.c_str(), &statbuf) == 0 &&
+        S_ISREG(statbuf.st_mode)) {
+      files.push_back({statbuf.st_mtime, name});
+    }
+  }
+  std::sort(files.begin(), files.end());
+  time_t now = time(nullptr);
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (files.size() - i > max_files || files[i].first + max_age < now) {
+      unlink(files[i].second.c_str());
+    }
+  }
+}
+
 std::string canonicalize_path(const char *path) {
   char *realpath_result = realpath(path, nullptr);
 
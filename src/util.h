@@ -14,9 +14,12 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <cinttypes>
 #include <climits>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 #include <list>
 #include <string>
 #include <t3config/config.h>
@@ -105,10 +108,40 @@ class stepped_process_t {
   static void ignore_result(stepped_process_t *process);
 };
 
+// FNV-1a. Unlike std::hash, the result is stable between runs.
+class fnv_hash_t {
+ public:
+  void update(const char *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      value ^= static_cast<unsigned char>(data[i]);
+      value *= UINT64_C(1099511628211);
+    }
+  }
+  std::string hex() const {
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016" PRIx64, value);
+    return buffer;
+  }
+
+ private:
+  uint64_t value = UINT64_C(14695981039346656037);
+};
+
 void enable_debugger_on_segfault(const char *_executable);
 void set_limits();
 
 std::string canonicalize_path(const char *path);
+/** Create directory @p dir and any missing parent directories. Returns @c false on failure. */
+bool make_dirs(const std::string &dir);
+/** Read a line from @p in into @p line, without the newline. Returns @c false if the end of the
+    file or an error was reached before a newline. */
+bool read_line(FILE *in, std::string *line);
+/** Returns the name of the cache file for @p key in the sub-directory @p dir of
+    $XDG_CACHE_HOME/tilde, or an empty string if there is no cache directory. */
+std::string get_cache_file_name(const char *dir, const std::string &key);
+/** Remove the files in @p dir that have not been written for @p max_age seconds, and the least
+    recently written files beyond the newest @p max_files. */
+void prune_cache_dir(const std::string &dir, size_t max_files, time_t max_age);
 void printf_into(std::string *message, const char *format, ...);
 
 int map_highlight(void *data, const char *name);
@@ -0,0 +1,214 @@
+#include "tilde/wordindex.h"
+
+#include <algorithm>
+#include <cctype>
+#include <unictype.h>
+#include <unistr.h>
+
+void split_words(string_view line, std::vector<string_view> *words) {
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(line.data());
+  size_t word_start = 0;
+  bool in_word = false;
+  for (size_t pos = 0; pos < line.size();) {
+    ucs4_t c = data[pos];
+    int length = 1;
+    if (c >= 0x80) {
+      length = u8_mbtouc(&c, data + pos, line.size() - pos);
+    }
+    bool is_word_char;
+    if (c < 0x80) {
+      is_word_char = isalnum(c) || c == '_';
+    } else if (uc_is_general_category(c, UC_CATEGORY_M)) {
+      // Combining marks belong to the preceding character.
+      is_word_char = in_word;
+    } else {
+      is_word_char = uc_is_general_category(
+          c, uc_general_category_or(UC_CATEGORY_L, uc_general_category_or(UC_CATEGORY_N,
+                                                                          UC_CATEGORY_Pc)));
+    }
+    if (is_word_char && !in_word) {
+      word_start = pos;
+    } else if (!is_word_char && in_word) {
+      words->push_back(line.substr(word_start, pos - word_start));
+    }
+    in_word = is_word_char;
+    pos += length;
+  }
+  if (in_word) {
+    words->push_back(line.substr(word_start));
+  }
+}
+
+void word_index_t::insert_lines(text_pos_t first, text_pos_t last) {
+  if (!built) {
+    discard_copy(first);
+    if (recording) {
+      changes.push_back({change_t::INSERT, first, last});
+    }
+    return;
+  }
+  if (first > static_cast<text_pos_t>(lines.size())) {
+    built = false;
+    return;
+  }
+  for (text_pos_t &line : dirty_lines) {
+    if (line >= first) {
+      line += last - first;
+    }
+  }
+  lines.insert(lines.begin() + first, last - first, line_t());
+  for (text_pos_t line = first; line < last; ++line) {
+    dirty_lines.push_back(line);
+  }
+}
+
+void word_index_t::erase_lines(text_pos_t first, text_pos_t last) {
+  if (!built) {
+    discard_copy(first);
+    if (recording) {
+      changes.push_back({change_t::ERASE, first, last});
+    }
+    return;
+  }
+  if (last > static_cast<text_pos_t>(lines.size())) {
+    built = false;
+    return;
+  }
+  for (text_pos_t line = first; line < last; ++line) {
+    release_words(&lines[line]);
+  }
+  lines.erase(lines.begin() + first, lines.begin() + last);
+  dirty_lines.erase(std::remove_if(dirty_lines.begin(), dirty_lines.end(),
+                                   [first, last](text_pos_t line) {
+                                     return line >= first && line < last;
+                                   }),
+                    dirty_lines.end());
+  for (text_pos_t &line : dirty_lines) {
+    if (line >= last) {
+      line -= last - first;
+    }
+  }
+}
+
+void word_index_t::invalidate_line(text_pos_t line) {
+  if (!built) {
+    discard_copy(line);
+    if (recording) {
+      changes.push_back({change_t::INVALIDATE, line, line + 1});
+    }
+  }
+  if (!built || line < 0 || line >= static_cast<text_pos_t>(lines.size()) || lines[line].dirty) {
+    return;
+  }
+  lines[line].dirty = true;
+  dirty_lines.push_back(line);
+}
+
+void word_index_t::find_prefix(const text_buffer_t *text, string_view prefix,
+                               std::vector<string_view> *words) {
+  update(text);
+  std::string prefix_str(prefix);
+  for (word_map_t::const_iterator iter = word_counts.lower_bound(prefix_str);
+       iter != word_counts.end() && iter->first.compare(0, prefix_str.size(), prefix_str) == 0;
+       ++iter) {
+    words->push_back(string_view(iter->first));
+  }
+}
+
+bool word_index_t::is_built() const { return built; }
+
+void word_index_t::build(const std::vector<std::string> &line_data) {
+  word_counts.clear();
+  lines.assign(line_data.size(), line_t());
+  dirty_lines.clear();
+  for (size_t i = 0; i < line_data.size(); ++i) {
+    lines[i].dirty = false;
+    add_words(&lines[i], line_data[i]);
+  }
+  built = true;
+}
+
+bool word_index_t::copy_lines(const text_buffer_t *text, text_pos_t count) {
+  for (; count > 0 && static_cast<text_pos_t>(copied_lines.size()) < text->size(); --count) {
+    copied_lines.push_back(text->get_line_data(copied_lines.size()).get_data());
+  }
+  return static_cast<text_pos_t>(copied_lines.size()) == text->size();
+}
+
+std::vector<std::string> word_index_t::take_copy() {
+  std::vector<std::string> result;
+  result.swap(copied_lines);
+  recording = true;
+  changes.clear();
+  return result;
+}
+
+void word_index_t::discard_copy(text_pos_t first) {
+  if (first >= 0 && first < static_cast<text_pos_t>(copied_lines.size())) {
+    copied_lines.erase(copied_lines.begin() + first, copied_lines.end());
+  }
+}
+
+void word_index_t::install(word_index_t &&index) {
+  std::vector<change_t> recorded_changes;
+  recorded_changes.swap(changes);
+  *this = std::move(index);
+  for (const change_t &change : recorded_changes) {
+    switch (change.type) {
+      case change_t::INSERT:
+        insert_lines(change.first, change.last);
+        break;
+      case change_t::ERASE:
+        erase_lines(change.first, change.last);
+        break;
+      case change_t::INVALIDATE:
+        invalidate_line(change.first);
+        break;
+    }
+  }
+}
+
+void word_index_t::update(const text_buffer_t *text) {
+  if (!built || static_cast<text_pos_t>(lines.size()) != text->size()) {
+    // Either the first lookup, or the notifications were missed. Start from scratch.
+    word_counts.clear();
+    lines.assign(text->size(), line_t());
+    dirty_lines.clear();
+    recording = false;
+    changes.clear();
+    for (text_pos_t line = 0; line < text->size(); ++line) {
+      dirty_lines.push_back(line);
+    }
+    built = true;
+  }
+  for (text_pos_t line : dirty_lines) {
+    update_line(text, line);
+  }
+  dirty_lines.clear();
+}
+
+void word_index_t::update_line(const text_buffer_t *text, text_pos_t line) {
+  line_t &info = lines[line];
+  release_words(&info);
+  info.dirty = false;
+  add_words(&info, text->get_line_data(line).get_data());
+}
+
+void word_index_t::add_words(line_t *line, const std::string &data) {
+  std::vector<string_view> words;
+  split_words(string_view(data), &words);
+  for (string_view word : words) {
+    word_map_t::iterator iter = word_counts.insert({std::string(word), 0}).first;
+    ++iter->second;
+    line->words.push_back(iter);
+  }
+}
+
+void word_index_t::release_words(line_t *line) {
+  for (word_map_t::iterator iter : line->words) {
+    if (--iter->second == 0) {
+      word_counts.erase(iter);
+    }
+  }
+  line->words.clear();
+}
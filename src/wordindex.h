@@ -0,0 +1,96 @@
+#ifndef WORDINDEX_H_
+#define WORDINDEX_H_
+
+#include <map>
+#include <string>
+#include <t3widget/textbuffer.h>
+#include <vector>
+
+using namespace t3widget;
+
+/** Append the words in @p line to @p words.
+
+    A word is a maximal run of letters, digits and connector punctuation such as '_', including
+    any combining marks that follow them. These are the characters for which
+    text_line_t::is_alnum returns true. Unlike text_line_t, this does not use libt3widget, so it
+    may be called from worker threads.
+*/
+void split_words(string_view line, std::vector<string_view> *words);
+
+/** The words in a text_buffer_t, for autocompletion.
+
+    Words are split by split_words. For each
+    distinct word the number of occurrences is kept, in a map sorted by word, such that the words
+    with a particular prefix are found with a range query. The words of each line are kept as
+    well, such that a line can be updated without scanning the rest of the buffer.
+
+    Edits only mark the affected lines, which are tokenized again on the next lookup. Until the
+    index is built nothing is tracked, except while the lines are copied for a build on another
+    thread, or while that build runs.
+*/
+class word_index_t {
+ public:
+  /** Lines [@p first, @p last) were inserted. */
+  void insert_lines(text_pos_t first, text_pos_t last);
+  /** Lines [@p first, @p last) were deleted. */
+  void erase_lines(text_pos_t first, text_pos_t last);
+  /** The contents of @p line changed. */
+  void invalidate_line(text_pos_t line);
+
+  /** Append the words in @p text that start with @p prefix to @p words, in sorted order.
+
+      The returned words remain valid until the next change to the index.
+  */
+  void find_prefix(const text_buffer_t *text, string_view prefix,
+                   std::vector<string_view> *words);
+
+  /** Returns whether the index has been built, i.e. lookups do not have to scan the buffer. */
+  bool is_built() const;
+  /** Build the index from a copy of the lines of a buffer. As this does not access the buffer,
+      it may run on any thread. */
+  void build(const std::vector<std::string> &line_data);
+  /** Copy up to @p count more lines of @p text, for a build on another thread.
+
+      This allows copying a large buffer in small steps. The copy of a line that is changed in
+      the meantime is discarded, together with those of the lines after it. Returns whether all
+      lines have been copied.
+  */
+  bool copy_lines(const text_buffer_t *text, text_pos_t count);
+  /** Returns the lines copied by copy_lines, and records the changes reported from now on. */
+  std::vector<std::string> take_copy();
+  /** Replace this index by @p index, built from the lines returned by take_copy, and apply the
+      changes recorded since. */
+  void install(word_index_t &&index);
+
+ private:
+  // Maps each word to its number of occurrences.
+  using word_map_t = std::map<std::string, int>;
+  struct line_t {
+    bool dirty = true;
+    std::vector<word_map_t::iterator> words;
+  };
+
+  // A change reported while recording.
+  struct change_t {
+    enum { INSERT, ERASE, INVALIDATE } type;
+    text_pos_t first, last;
+  };
+
+  void update(const text_buffer_t *text);
+  void update_line(const text_buffer_t *text, text_pos_t line);
+  void add_words(line_t *line, const std::string &data);
+  void release_words(line_t *line);
+  void discard_copy(text_pos_t first);
+
+  word_map_t word_counts;
+  std::vector<line_t> lines;
+  // The lines with dirty set, in no particular order.
+  std::vector<text_pos_t> dirty_lines;
+  bool built = false;
+  bool recording = false;
+  std::vector<change_t> changes;
+  // The lines copied so far by copy_lines.
+  std::vector<std::string> copied_lines;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "tilde/worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+worker_pool_t worker_pool;
+
+worker_pool_t::worker_pool_t(size_t _max_threads) : max_threads(_max_threads) {
+  if (max_threads == 0) {
+    max_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+worker_pool_t::~worker_pool_t() { shutdown(); }
+
+void worker_pool_t::shutdown() {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    stopping = true;
+    tasks.clear();
+  }
+  tasks_available.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+}
+
+void worker_pool_t::start_threads() {
+  // Must be called with the lock held.
+  while (threads.size() < max_threads) {
+    threads.emplace_back(&worker_pool_t::run_worker, this);
+  }
+}
+
+void worker_pool_t::submit(task_t task) {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    if (stopping) {
+      return;
+    }
+    if (threads.empty()) {
+      start_threads();
+    }
+    tasks.push_back(std::move(task));
+  }
+  tasks_available.notify_one();
+}
+
+void worker_pool_t::run_worker() {
+  while (true) {
+    task_t task;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      tasks_available.wait(guard, [this] { return stopping || !tasks.empty(); });
+      if (stopping) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+namespace {
+
+/* The state for run_parallel is shared with the helper tasks through a shared_ptr, because helper
+   tasks may only be started after all indices have been processed and run_parallel has returned.
+   Such tasks must then still be able to see that there is nothing left to do. */
+struct parallel_state_t {
+  std::function<void(size_t)> func;
+  size_t count;
+  std::atomic<size_t> next{0};
+  size_t completed = 0;
+  std::mutex lock;
+  std::condition_variable all_completed;
+
+  void run() {
+    size_t local_completed = 0;
+    size_t idx;
+    while ((idx = next++) < count) {
+      func(idx);
+      ++local_completed;
+    }
+    if (local_completed == 0) {
+      return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    completed += local_completed;
+    if (completed == count) {
+      all_completed.notify_all();
+    }
+  }
+};
+
+}  // namespace
+
+void worker_pool_t::run_parallel(size_t count, const std::function<void(size_t)> &func) {
+  if (count == 0) {
+    return;
+  }
+  if (count == 1 || max_threads == 1) {
+    for (size_t i = 0; i < count; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  std::shared_ptr<parallel_state_t> state = std::make_shared<parallel_state_t>();
+  state->func = func;
+  state->count = count;
+
+  size_t helpers = std::min(count, max_threads) - 1;
+  for (size_t i = 0; i < helpers; ++i) {
+    submit([state] { state->run(); });
+  }
+  state->run();
+
+  std::unique_lock<std::mutex> guard(state->lock);
+  state->all_completed.wait(guard, [&state] { return state->completed == state->count; });
+}
+
+size_t worker_pool_t::get_max_threads() const { return max_threads; }
@@ -0,0 +1,71 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** A pool of worker threads for work that does not touch the user interface.
+
+    The threads are only started when the first task is submitted. Tasks must not call into
+    libt3widget, as that library is not thread safe. The only exception is signal_update, which
+    tasks may call to wake up the main loop when they have produced a result. It only queues an
+    update event in the key buffer, which libt3widget already shares between its key reading
+    thread and the main thread under a lock.
+*/
+class worker_pool_t {
+ public:
+  using task_t = std::function<void()>;
+
+  /** Create a new pool. If @p max_threads is 0, the number of hardware threads is used. */
+  explicit worker_pool_t(size_t max_threads = 0);
+  ~worker_pool_t();
+
+  /** Queue @p task for execution on one of the worker threads. Tasks submitted after shutdown
+      are dropped. */
+  void submit(task_t task);
+
+  /** Call @p func for each index in [0, @p count) and wait until all calls have completed.
+
+      The calls are distributed over the worker threads, and the calling thread executes calls
+      as well while it is waiting. The order in which the indices are processed is undefined.
+
+      If the calling thread is the main thread, it can not modify any text_buffer_t until all
+      calls have completed. The calls may therefore read lines from a text_buffer_t through
+      text_buffer_t::size, text_buffer_t::get_line_data, text_line_t::get_data and
+      text_line_t::get_line_factory. These are const members that only return data owned by the
+      buffer, and the main thread is the only one that modifies that data. No other
+      libt3widget calls are allowed, and the lines must not be accessed through pointers that
+      outlive the call to run_parallel.
+  */
+  void run_parallel(size_t count, const std::function<void(size_t)> &func);
+
+  /** Returns the number of threads that will be used to run tasks. */
+  size_t get_max_threads() const;
+
+  /** Drop the queued tasks and wait for the running tasks to finish.
+
+      Must be called from the main thread before it starts tearing down the state that tasks may
+      use, such as the log and libt3widget. Long running tasks should be asked to stop first.
+  */
+  void shutdown();
+
+ private:
+  void start_threads();
+  void run_worker();
+
+  size_t max_threads;
+  std::vector<std::thread> threads;
+  std::deque<task_t> tasks;
+  std::mutex lock;
+  std::condition_variable tasks_available;
+  bool stopping = false;
+};
+
+extern worker_pool_t worker_pool;
+
+#endif
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tilde/braceindex.h"
+
+namespace {
+
+class BraceIndexTest : public ::testing::Test {
+ protected:
+  std::string random_line() {
+    static const char chars[] = "()[]{}x";
+    std::string line;
+    int length = std::uniform_int_distribution<int>(0, 6)(rng_);
+    for (int i = 0; i < length; ++i) {
+      line += chars[std::uniform_int_distribution<int>(0, sizeof(chars) - 2)(rng_)];
+    }
+    return line;
+  }
+
+  void set_line(text_pos_t line) {
+    brace_summary_t summaries[brace_index_t::kinds];
+    for (char c : lines_[line]) {
+      int kind = brace_index_t::get_kind(c);
+      if (kind >= 0) summaries[kind].add(c == '(' || c == '[' || c == '{');
+    }
+    index_.set_line(line, summaries);
+  }
+
+  void insert_lines(text_pos_t first, text_pos_t last) {
+    for (text_pos_t i = first; i < last; ++i) {
+      lines_.insert(lines_.begin() + i, random_line());
+    }
+    index_.insert_lines(first, last);
+    for (text_pos_t i = first; i < last; ++i) {
+      set_line(i);
+    }
+  }
+
+  void erase_lines(text_pos_t first, text_pos_t last) {
+    lines_.erase(lines_.begin() + first, lines_.begin() + last);
+    index_.erase_lines(first, last);
+  }
+
+  void change_line(text_pos_t line) {
+    lines_[line] = random_line();
+    index_.invalidate_line(line);
+    set_line(line);
+  }
+
+  // Returns +1 for an opening and -1 for a closing brace of kind @p kind, or 0 otherwise.
+  static int count(int kind, char c) {
+    if (brace_index_t::get_kind(c) != kind) return 0;
+    return c == '(' || c == '[' || c == '{' ? 1 : -1;
+  }
+
+  // Linear scan equivalent of brace_index_t::find_forward.
+  text_pos_t scan_forward(int kind, text_pos_t first, text_pos_t last, int *depth) const {
+    for (text_pos_t i = first; i < last; ++i) {
+      int line_depth = *depth;
+      for (char c : lines_[i]) {
+        line_depth += count(kind, c);
+        if (line_depth <= 0) return i;
+      }
+      *depth = line_depth;
+    }
+    return -1;
+  }
+
+  // Linear scan equivalent of brace_index_t::find_backward.
+  text_pos_t scan_backward(int kind, text_pos_t first, text_pos_t last, int *need) const {
+    for (text_pos_t i = last - 1; i >= first; --i) {
+      int surplus = 0;
+      int sum = 0;
+      for (char c : lines_[i]) {
+        sum += count(kind, c);
+        surplus = std::max(0, surplus + count(kind, c));
+      }
+      if (surplus >= *need) return i;
+      *need -= sum;
+    }
+    return -1;
+  }
+
+  void check_searches() {
+    text_pos_t size = lines_.size();
+    ASSERT_EQ(size, index_.size());
+    for (int i = 0; i < 20; ++i) {
+      int kind = std::uniform_int_distribution<int>(0, brace_index_t::kinds - 1)(rng_);
+      text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size)(rng_);
+      text_pos_t last = std::uniform_int_distribution<text_pos_t>(first, size)(rng_);
+      int start = std::uniform_int_distribution<int>(1, 4)(rng_);
+
+      int expected_depth = start;
+      int depth = start;
+      text_pos_t expected = scan_forward(kind, first, last, &expected_depth);
+      EXPECT_EQ(expected, index_.find_forward(kind, first, last, &depth))
+          << "kind " << kind << " [" << first << ", " << last << ") depth " << start;
+      EXPECT_EQ(expected_depth, depth);
+
+      int expected_need = start;
+      int need = start;
+      expected = scan_backward(kind, first, last, &expected_need);
+      EXPECT_EQ(expected, index_.find_backward(kind, first, last, &need))
+          << "kind " << kind << " [" << first << ", " << last << ") need " << start;
+      EXPECT_EQ(expected_need, need);
+    }
+  }
+
+  std::mt19937 rng_{12345};
+  std::vector<std::string> lines_;
+  brace_index_t index_;
+};
+
+TEST_F(BraceIndexTest, MatchesLinearScan) {
+  for (int iteration = 0; iteration < 200; ++iteration) {
+    text_pos_t size = std::uniform_int_distribution<text_pos_t>(0, 70)(rng_);
+    lines_.clear();
+    index_.reset(0);
+    insert_lines(0, size);
+    check_searches();
+    if (HasFailure()) return;
+  }
+}
+
+TEST_F(BraceIndexTest, MatchesLinearScanAfterEdits) {
+  insert_lines(0, 40);
+  for (int iteration = 0; iteration < 500; ++iteration) {
+    text_pos_t size = lines_.size();
+    switch (std::uniform_int_distribution<int>(0, 2)(rng_)) {
+      case 0: {
+        text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size)(rng_);
+        insert_lines(first, first + std::uniform_int_distribution<text_pos_t>(1, 5)(rng_));
+        break;
+      }
+      case 1: {
+        text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size)(rng_);
+        text_pos_t last =
+            std::min(size, first + std::uniform_int_distribution<text_pos_t>(0, 5)(rng_));
+        erase_lines(first, last);
+        break;
+      }
+      default:
+        if (size > 0) change_line(std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng_));
+        break;
+    }
+    check_searches();
+    if (HasFailure()) return;
+  }
+}
+
+TEST_F(BraceIndexTest, FindInvalidMatchesLinearScan) {
+  // Tracks which lines were set, as lines_ is not used here.
+  std::vector<bool> valid(30, false);
+  index_.reset(valid.size());
+  brace_summary_t summaries[brace_index_t::kinds];
+  for (int iteration = 0; iteration < 2000; ++iteration) {
+    text_pos_t size = valid.size();
+    switch (std::uniform_int_distribution<int>(0, 3)(rng_)) {
+      case 0: {
+        text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size)(rng_);
+        text_pos_t count = std::uniform_int_distribution<text_pos_t>(1, 5)(rng_);
+        valid.insert(valid.begin() + first, count, false);
+        index_.insert_lines(first, first + count);
+        break;
+      }
+      case 1: {
+        text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size)(rng_);
+        text_pos_t last =
+            std::min(size, first + std::uniform_int_distribution<text_pos_t>(0, 5)(rng_));
+        valid.erase(valid.begin() + first, valid.begin() + last);
+        index_.erase_lines(first, last);
+        break;
+      }
+      case 2:
+        if (size > 0) {
+          text_pos_t line = std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng_);
+          valid[line] = false;
+          index_.invalidate_line(line);
+        }
+        break;
+      default:
+        // Set several lines, such that most lines are valid.
+        for (int i = 0; i < 4 && size > 0; ++i) {
+          text_pos_t line = std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng_);
+          valid[line] = true;
+          index_.set_line(line, summaries);
+        }
+        break;
+    }
+
+    size = valid.size();
+    ASSERT_EQ(size, index_.size());
+    text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size)(rng_);
+    text_pos_t last = std::uniform_int_distribution<text_pos_t>(first, size)(rng_);
+    text_pos_t expected = std::find(valid.begin() + first, valid.begin() + last, false) -
+                          valid.begin();
+    EXPECT_EQ(expected == last ? -1 : expected, index_.find_invalid(first, last))
+        << "[" << first << ", " << last << ")";
+    for (text_pos_t line = 0; line < size; ++line) {
+      ASSERT_EQ(valid[line], index_.is_valid(line)) << "line " << line;
+    }
+  }
+}
+
+}  // namespace
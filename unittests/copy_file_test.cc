@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <sys/stat.h>
 #include <t3widget/util.h>
 #include <unistd.h>
 
@@ -277,6 +278,110 @@ TEST_F(CopyFileTest, FicloneWithContentNonReflinkFs) {
   EXPECT_EQ(copy_file_by_ficlone(src_name_and_fd_.second, dest_name_and_fd_.second), ENOTSUP);
 }
 
+// ======================= copy_file =========================================
+TEST_F(CopyFileTest, CopyFileSparse) {
+  const off_t hole_size = 16 * 1024 * 1024;
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  QCHECK(lseek(src_name_and_fd_.second, hole_size, SEEK_CUR) != (off_t)-1);
+  QCHECK(t3widget::nosig_write(src_name_and_fd_.second, "efgh", 4) == 4);
+  // Leave a hole at the end of the file as well.
+  QCHECK(ftruncate(src_name_and_fd_.second, 2 * hole_size) == 0);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  struct stat statbuf;
+  ASSERT_EQ(fstat(dest_name_and_fd_.second, &statbuf), 0);
+  EXPECT_EQ(statbuf.st_size, 2 * hole_size);
+  EXPECT_LT(statbuf.st_blocks * 512, hole_size);
+}
+
+TEST_F(CopyFileTest, CopyFileTruncatesDestination) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+// ======================= copy_file strategy selection ======================
+class CopyFileStrategyTest : public CopyFileTest {
+ protected:
+  CopyFileStrategyTest() { clear_copy_file_cache(); }
+};
+
+TEST_F(CopyFileStrategyTest, InitiallyTriesFiclone) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(get_copy_file_strategy(src_name_and_fd_.second, dest_name_and_fd_.second),
+            copy_strategy_t::BY_FICLONE);
+}
+
+TEST_F(CopyFileStrategyTest, SelectsFicloneOnReflinkFs) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_EQ(get_copy_file_strategy(src_name_and_fd_.second, dest_name_and_fd_.second),
+            copy_strategy_t::BY_FICLONE);
+}
+
+TEST_F(CopyFileStrategyTest, SelectsCopyFileRangeOnNonReflinkFs) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_EQ(get_copy_file_strategy(src_name_and_fd_.second, dest_name_and_fd_.second),
+            copy_strategy_t::BY_COPY_FILE_RANGE);
+}
+
+TEST_F(CopyFileStrategyTest, DoesNotSelectFicloneCrossFs) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  /* Whether copy_file_range works across file systems depends on the kernel version (it does
+     between Linux 5.3 and 5.18), so either it or sendfile may be selected. */
+  EXPECT_NE(get_copy_file_strategy(src_name_and_fd_.second, dest_name_and_fd_.second),
+            copy_strategy_t::BY_FICLONE);
+}
+
+TEST_F(CopyFileStrategyTest, StrategyIsCachedPerFileSystem) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  auto reflink_src_name_and_fd = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  auto reflink_dest_name_and_fd = CreateFile(FLAGS_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_EQ(get_copy_file_strategy(reflink_src_name_and_fd.second, reflink_dest_name_and_fd.second),
+            copy_strategy_t::BY_FICLONE);
+
+  close(reflink_src_name_and_fd.second);
+  close(reflink_dest_name_and_fd.second);
+  unlink(reflink_src_name_and_fd.first.c_str());
+  unlink(reflink_dest_name_and_fd.first.c_str());
+}
+
+TEST_F(CopyFileStrategyTest, CacheHitsAreCounted) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  copy_file_cache_stats_t stats = get_copy_file_cache_stats();
+  EXPECT_EQ(stats.hits, 0u);
+  EXPECT_EQ(stats.misses, 1u);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  stats = get_copy_file_cache_stats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 1u);
+}
+
 }
 
 int main(int argc, char **argv) {
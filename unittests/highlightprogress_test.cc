@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tilde/highlightprogress.h"
+
+namespace {
+
+/* A buffer in a language where '<' starts a state that '>' ends, with the start states kept up to
+   date by a highlight_progress_t in the same way as by file_buffer_t. */
+class HighlightProgressTest : public ::testing::Test {
+ protected:
+  int get_end(text_pos_t line) const {
+    int state = states_[line];
+    for (char c : lines_[line]) {
+      if (c == '<') {
+        state = 1;
+      } else if (c == '>') {
+        state = 0;
+      }
+    }
+    return state;
+  }
+
+  // Make the start states up to @p line valid, as painting the line does.
+  void prepare(text_pos_t line, bool use_range = false) {
+    progress_.update(line, lines_.size(),
+                     [this](text_pos_t i) {
+                       int state = get_end(i - 1);
+                       bool changed = states_[i] != state;
+                       states_[i] = state;
+                       return changed;
+                     },
+                     [this, line, use_range](text_pos_t i) {
+                       if (!use_range) {
+                         return false;
+                       }
+                       for (; i <= line; ++i) {
+                         states_[i] = get_end(i - 1);
+                       }
+                       return true;
+                     });
+  }
+
+  // Inserted lines get a placeholder start state, as in file_buffer_t::invalidate_highlight.
+  void insert_lines(text_pos_t first, const std::vector<std::string> &new_lines) {
+    lines_.insert(lines_.begin() + first, new_lines.begin(), new_lines.end());
+    states_.insert(states_.begin() + first, new_lines.size(), 0);
+    progress_.insert_lines(first, first + new_lines.size());
+  }
+
+  void erase_lines(text_pos_t first, text_pos_t last) {
+    lines_.erase(lines_.begin() + first, lines_.begin() + last);
+    states_.erase(states_.begin() + first, states_.begin() + last);
+    progress_.erase_lines(first, last);
+  }
+
+  void change_line(text_pos_t line, const std::string &data) {
+    lines_[line] = data;
+    progress_.change_line(line);
+  }
+
+  void check_valid() {
+    int state = 0;
+    for (text_pos_t i = 0; i <= progress_.valid; ++i) {
+      ASSERT_EQ(state, states_[i]) << "line " << i << " of " << lines_.size();
+      state = get_end(i);
+    }
+  }
+
+  void set_text(const std::vector<std::string> &lines) {
+    lines_ = lines;
+    states_.assign(lines_.size(), 0);
+    progress_.reset();
+  }
+
+  std::vector<std::string> lines_;
+  std::vector<int> states_;
+  highlight_progress_t progress_;
+};
+
+TEST_F(HighlightProgressTest, PaintAfterMultiLineInsert) {
+  set_text(std::vector<std::string>(10, "x"));
+  prepare(9);
+  insert_lines(3, {"a", "<", "b"});
+  // Lines are painted one at a time.
+  for (text_pos_t line = 0; line < static_cast<text_pos_t>(lines_.size()); ++line) {
+    prepare(line);
+    check_valid();
+  }
+  EXPECT_EQ(1, states_[5]);
+  EXPECT_EQ(1, states_.back());
+}
+
+TEST_F(HighlightProgressTest, PaintAboveEditedLines) {
+  set_text(std::vector<std::string>(10, "x"));
+  prepare(9);
+  change_line(6, "<");
+  change_line(2, "y");
+  prepare(3);
+  check_valid();
+  prepare(9);
+  check_valid();
+  EXPECT_EQ(1, states_[7]);
+}
+
+TEST_F(HighlightProgressTest, RandomEdits) {
+  static const char *const contents[] = {"x", "<", ">", "<>", "><"};
+  std::mt19937 rng(4242);
+  auto random_line = [&rng]() { return contents[std::uniform_int_distribution<int>(0, 4)(rng)]; };
+
+  set_text(std::vector<std::string>(30, "x"));
+  for (int iteration = 0; iteration < 2000; ++iteration) {
+    text_pos_t size = lines_.size();
+    switch (std::uniform_int_distribution<int>(0, 3)(rng)) {
+      case 0: {
+        std::vector<std::string> new_lines(std::uniform_int_distribution<int>(1, 4)(rng));
+        for (std::string &line : new_lines) {
+          line = random_line();
+        }
+        // The first line is never inserted before, as its start state is fixed.
+        insert_lines(std::uniform_int_distribution<text_pos_t>(1, size)(rng), new_lines);
+        break;
+      }
+      case 1: {
+        if (size < 3) break;
+        text_pos_t first = std::uniform_int_distribution<text_pos_t>(1, size - 1)(rng);
+        text_pos_t last = std::min(size, first + std::uniform_int_distribution<int>(1, 4)(rng));
+        erase_lines(first, last);
+        break;
+      }
+      case 2:
+        change_line(std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng), random_line());
+        break;
+      default: {
+        // Paint a few consecutive lines, as a window does.
+        text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng);
+        text_pos_t last = std::min(size, first + std::uniform_int_distribution<int>(1, 8)(rng));
+        bool use_range = std::uniform_int_distribution<int>(0, 1)(rng) == 0;
+        for (text_pos_t line = first; line < last; ++line) {
+          prepare(line, use_range);
+          check_valid();
+        }
+        break;
+      }
+    }
+    if (HasFailure()) return;
+  }
+}
+
+}  // namespace
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <t3widget/textbuffer.h>
+#include <vector>
+
+#include "tilde/wordindex.h"
+
+namespace {
+
+/* Tests for building a word_index_t from a snapshot while the buffer is edited. The edits are
+   applied to a vector of lines, which is turned into a text_buffer_t only for the lookups. */
+class WordIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    lines_ = {"alpha beta", "gamma", "", "beta delta_1", "epsilon alpha", "zeta", "eta theta"};
+  }
+
+  // Copy the lines for a build, as schedule_word_index_build does.
+  void start_build() {
+    std::unique_ptr<text_buffer_t> buffer = make_buffer();
+    while (!index_.copy_lines(buffer.get(), 2)) {
+    }
+    snapshot_ = index_.take_copy();
+  }
+
+  // Build an index from the snapshot and install it, as the worker and main thread do.
+  void finish_build() {
+    word_index_t built;
+    built.build(snapshot_);
+    index_.install(std::move(built));
+  }
+
+  void insert_lines(text_pos_t first, const std::vector<std::string> &new_lines) {
+    lines_.insert(lines_.begin() + first, new_lines.begin(), new_lines.end());
+    index_.insert_lines(first, first + new_lines.size());
+  }
+
+  void erase_lines(text_pos_t first, text_pos_t last) {
+    lines_.erase(lines_.begin() + first, lines_.begin() + last);
+    index_.erase_lines(first, last);
+  }
+
+  void change_line(text_pos_t line, const std::string &data) {
+    lines_[line] = data;
+    index_.invalidate_line(line);
+  }
+
+  std::unique_ptr<text_buffer_t> make_buffer() const {
+    std::string data;
+    for (const std::string &line : lines_) {
+      if (&line != &lines_.front()) data += '\n';
+      data += line;
+    }
+    std::unique_ptr<text_buffer_t> buffer(new text_buffer_t());
+    buffer->append_text(data);
+    return buffer;
+  }
+
+  static std::vector<std::string> find_all(word_index_t *index, const text_buffer_t *buffer) {
+    std::vector<string_view> words;
+    index->find_prefix(buffer, "", &words);
+    return std::vector<std::string>(words.begin(), words.end());
+  }
+
+  /* Compare the words in index_ to those in an index built from the current lines. Then check
+     that the counts were right, by removing all lines: no words may be left. */
+  void check_index() {
+    std::unique_ptr<text_buffer_t> buffer = make_buffer();
+    // A buffer always has a line, and a line count that differs from the index makes it start
+    // from scratch, which would hide the errors this is looking for.
+    ASSERT_FALSE(lines_.empty());
+    ASSERT_EQ(static_cast<text_pos_t>(lines_.size()), buffer->size());
+    ASSERT_TRUE(index_.is_built());
+
+    word_index_t fresh;
+    EXPECT_EQ(find_all(&fresh, buffer.get()), find_all(&index_, buffer.get()));
+
+    index_.erase_lines(0, lines_.size());
+    index_.insert_lines(0, 1);
+    lines_.assign(1, std::string());
+    buffer = make_buffer();
+    EXPECT_TRUE(find_all(&index_, buffer.get()).empty());
+  }
+
+  std::vector<std::string> lines_;
+  std::vector<std::string> snapshot_;
+  word_index_t index_;
+};
+
+TEST_F(WordIndexTest, NoEdits) {
+  start_build();
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, InsertBeforeDirtyLine) {
+  start_build();
+  change_line(4, "iota kappa");
+  insert_lines(1, {"lambda mu", "alpha"});
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, InsertAfterDirtyLine) {
+  start_build();
+  change_line(1, "iota kappa");
+  insert_lines(3, {"lambda mu", "alpha"});
+  change_line(6, "nu");
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, InsertBetweenInsertedLines) {
+  start_build();
+  insert_lines(2, {"lambda", "mu"});
+  insert_lines(3, {"nu xi"});
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, EraseSpanningDirtyLines) {
+  start_build();
+  change_line(2, "iota");
+  insert_lines(4, {"lambda mu", "nu"});
+  erase_lines(1, 5);
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, EraseAllInsertedLines) {
+  start_build();
+  insert_lines(3, {"lambda mu", "nu"});
+  change_line(4, "xi");
+  erase_lines(3, 5);
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, EditWhileCopying) {
+  std::unique_ptr<text_buffer_t> buffer = make_buffer();
+  EXPECT_FALSE(index_.copy_lines(buffer.get(), 5));
+  change_line(2, "iota");
+  insert_lines(6, {"kappa"});
+  buffer = make_buffer();
+  EXPECT_FALSE(index_.copy_lines(buffer.get(), 5));
+  erase_lines(0, 1);
+  buffer = make_buffer();
+  while (!index_.copy_lines(buffer.get(), 1)) {
+  }
+  snapshot_ = index_.take_copy();
+  EXPECT_EQ(lines_, snapshot_);
+  change_line(3, "lambda");
+  finish_build();
+  check_index();
+}
+
+TEST_F(WordIndexTest, RandomEdits) {
+  static const char *const vocabulary[] = {"alpha", "beta", "gamma", "delta_1", "é", "x2"};
+  std::mt19937 rng(54321);
+  auto random_line = [&rng]() {
+    std::string line;
+    int word_count = std::uniform_int_distribution<int>(0, 3)(rng);
+    for (int i = 0; i < word_count; ++i) {
+      line += vocabulary[std::uniform_int_distribution<int>(0, 5)(rng)];
+      line += ' ';
+    }
+    return line;
+  };
+
+  for (int iteration = 0; iteration < 200; ++iteration) {
+    index_ = word_index_t();
+    lines_.clear();
+    int line_count = std::uniform_int_distribution<int>(1, 10)(rng);
+    for (int i = 0; i < line_count; ++i) {
+      lines_.push_back(random_line());
+    }
+
+    // The edits are made both while the lines are copied and while the build runs.
+    bool copied = false;
+    int edit_count = std::uniform_int_distribution<int>(0, 8)(rng);
+    for (int i = 0; i < edit_count; ++i) {
+      if (!copied) {
+        std::unique_ptr<text_buffer_t> buffer = make_buffer();
+        if (index_.copy_lines(buffer.get(), std::uniform_int_distribution<int>(0, 3)(rng))) {
+          snapshot_ = index_.take_copy();
+          copied = true;
+        }
+      }
+      text_pos_t size = lines_.size();
+      switch (std::uniform_int_distribution<int>(0, 2)(rng)) {
+        case 0: {
+          std::vector<std::string> new_lines(std::uniform_int_distribution<int>(1, 3)(rng));
+          for (std::string &line : new_lines) {
+            line = random_line();
+          }
+          insert_lines(std::uniform_int_distribution<text_pos_t>(0, size)(rng), new_lines);
+          break;
+        }
+        case 1: {
+          if (size < 2) break;
+          text_pos_t first = std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng);
+          // Keep at least one line, as a buffer always has one.
+          text_pos_t last =
+              std::uniform_int_distribution<text_pos_t>(first, first + size - 1)(rng);
+          erase_lines(first, std::min(last, size));
+          break;
+        }
+        default:
+          change_line(std::uniform_int_distribution<text_pos_t>(0, size - 1)(rng), random_line());
+          break;
+      }
+    }
+    if (!copied) {
+      start_build();
+    }
+    finish_build();
+    check_index();
+    if (HasFailure()) return;
+  }
+}
+
+}  // namespace